@@ -43,7 +43,7 @@ static int hello_getattr(const char *path, struct stat *stbuf) {
     if (!repli) return -ENOMEM;
     if (!path) return 0;
     memset(stbuf, 0, sizeof(struct stat));
-    replifs::File *fio = repli->get_repli_fio(path);
+    auto fio = repli->hold_fio(path);
     if (fio) {
         memcpy(stbuf, &fio->st, sizeof(struct stat));
         return 0;
@@ -57,7 +57,7 @@ static int repli_setattr(const char *path, struct stat *stbuf) {
     if (!repli)
         return -ENOMEM;
 
-    replifs::File *fio = repli->get_repli_fio(path);
+    auto fio = repli->hold_fio(path);
     if (fio) {
         auto r = repli->set(*stbuf); /// update changes
         if (!r) {
@@ -116,7 +116,8 @@ static int hello_open(const char *path, struct fuse_file_info *fi) {
     if (fi->fh) {
         return -EBADF;
     }
-    replifs::File *fio = repli->get_repli_fio(path);
+    // the handle keeps the File until release
+    replifs::File *fio = repli->open_fio(path);
     if (!fio) {
         return -ENOENT;// TODO: really invalid path
     }
@@ -138,6 +139,8 @@ int repli_release(const char *path, struct fuse_file_info *fi) {
     if (fi->fh) {
         replifs::File *fio = (replifs::File *) (void *) fi->fh;
         auto r = repli->set(fio); /// update changes
+        fi->fh = 0;
+        repli->release_fio(fio->st.st_ino);
         if (!r) {
             return -EIO;
         }
@@ -267,7 +270,7 @@ static int repli_create(const char *path, mode_t mode, struct fuse_file_info *fi
 
     auto r = repli_mknod(path, mode, 0);
     if (r == 0) {
-        replifs::File *fio = repli->get_repli_fio(path);
+        replifs::File *fio = repli->open_fio(path);
         if (!fio) {
             return -ENOENT;// TODO: really invalid path
         }
@@ -280,7 +283,7 @@ static int repli_create(const char *path, mode_t mode, struct fuse_file_info *fi
 static int repli_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
     if (!repli)
         return -ENOMEM;
-    replifs::File *fio = repli->get_repli_fio(path);
+    auto fio = repli->hold_fio(path);
     if (!fio) {
         return -ENOENT;// TODO: really invalid path
     }
@@ -294,12 +297,12 @@ static int repli_ftruncate(const char *path, off_t offset, struct fuse_file_info
 static int repli_truncate(const char *path, off_t offset) {
     if (!repli)
         return -ENOMEM;
-    replifs::File *fio = repli->get_repli_fio(path);
+    auto fio = repli->hold_fio(path);
     if (!fio) {
         return -ENOENT;// TODO: really invalid path
     }
     fio->st.st_size = offset;
-    repli->set(fio);
+    repli->set(fio.get());
 
     return 0;
 }
@@ -307,7 +310,7 @@ static int repli_truncate(const char *path, off_t offset) {
 static int repli_readlink(const char *path, char *name, size_t len) {
     if (!repli)
         return -ENOMEM;
-    replifs::File *fio = repli->get_repli_fio(path);
+    auto fio = repli->hold_fio(path);
     if (!fio) {
         return -ENOENT;// TODO: really invalid path
     }
@@ -353,8 +356,7 @@ static int repli_mknod(const char *path, mode_t mode, dev_t dev, struct stat &st
     auto cr = repli->create(path, id, nullptr, 0);
     if (cr.first) {
         repli->set(st);
-        replifs::File *fio = repli->get_repli_fio(path);
-        if (!fio) {
+        if (!repli->hold_fio(path)) {
             return -ENOENT;// TODO: really invalid path
         }
         return 0;
@@ -430,7 +432,7 @@ static int repli_link(const char *path_from, const char *path_to) {
 static int repli_chmod(const char *path, mode_t mode) {
     if (!repli) return -ENOMEM;
 
-    replifs::File *fio = repli->get_repli_fio(path);
+    auto fio = repli->hold_fio(path);
     if (!fio) {
         return -ENOENT;// TODO: really invalid path
     }
@@ -446,7 +448,7 @@ static int repli_chmod(const char *path, mode_t mode) {
 static int repli_chown(const char *path, uid_t uid, gid_t gid) {
     if (!repli)
         return -ENOMEM;
-    replifs::File *fio = repli->get_repli_fio(path);
+    auto fio = repli->hold_fio(path);
     if (!fio) {
         return -ENOENT;// TODO: really invalid path
     }
@@ -454,7 +456,7 @@ static int repli_chown(const char *path, uid_t uid, gid_t gid) {
     fio->st.st_uid = uid;
     fio->st.st_gid = gid;
 
-    if (!repli->set(fio)) {
+    if (!repli->set(fio.get())) {
         return -ENOMEM;
     }
     return 0;
@@ -8,7 +8,7 @@
   gcc -Wall hello_ll.c `pkg-config fuse --cflags --libs` -o hello_ll
 */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
 #include <fuse_lowlevel.h>
 #include <stdio.h>
@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stddef.h>
 
 #include <cstring>
 #include <string.h>
@@ -45,18 +46,61 @@ int clock_gettime(int /*clk_id*/, struct timespec* t) {
 #endif
 //////////// WARNING : PROBABLY BAD HACK FROM STACK OVERFLOW ////////
 
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
 // a test block size to force splitting
 #define REPLI_BLOCKSIZE 1024ull*32ull
 
 std::shared_ptr<replifs::resources> repli;
 
+/// -o attr_timeout=<secs>,entry_timeout=<secs>,writeback|no_writeback,commit_window=<ms>,commit_ops=<n>,
+///    compact_rate=<KiB/s>,cache_size=<MiB>,cache_2q|cache_lru,inode_cache=<n>,negative_timeout=<secs>
+struct repli_options {
+    double attr_timeout;
+    double entry_timeout;
+    int writeback;
+    int commit_window;
+    int commit_ops;
+    int compact_rate;
+    int cache_size;
+    int cache_policy;
+    int inode_cache;
+    double negative_timeout;
+};
+
+// every change made here is a kernel request the kernel's caches already reflect, so
+// attributes and entries can be cached for a long time as long as nothing else writes
+// to the data store while it is mounted
+static struct repli_options options = {86400.0, 86400.0, 1, 10, 1024, 4096, 128, nst::policy_2q, 65536, 86400.0};
+
+#define REPLI_OPT(t, p, v) { t, offsetof(struct repli_options, p), v }
+
+static const struct fuse_opt repli_opts[] = {
+        REPLI_OPT("attr_timeout=%lf", attr_timeout, 0),
+        REPLI_OPT("entry_timeout=%lf", entry_timeout, 0),
+        REPLI_OPT("writeback", writeback, 1),
+        REPLI_OPT("no_writeback", writeback, 0),
+        REPLI_OPT("commit_window=%d", commit_window, 0),
+        REPLI_OPT("commit_ops=%d", commit_ops, 0),
+        REPLI_OPT("compact_rate=%d", compact_rate, 0),
+        REPLI_OPT("cache_size=%d", cache_size, 0),
+        REPLI_OPT("cache_2q", cache_policy, nst::policy_2q),
+        REPLI_OPT("cache_lru", cache_policy, nst::policy_lru),
+        REPLI_OPT("inode_cache=%d", inode_cache, 0),
+        REPLI_OPT("negative_timeout=%lf", negative_timeout, 0),
+        FUSE_OPT_END
+};
+
 static int repli_mknod(uint64_t context, const char *name, mode_t mode, dev_t dev, struct stat &st);
 
 static int hello_stat(fuse_ino_t ino, struct stat *stbuf) {
-    auto fio = repli->get_repli_fio(ino);
-    if (fio == nullptr) {
+    auto fio = repli->hold_fio(ino);
+    if (!fio) {
         return -1;
     }
+    std::unique_lock<std::mutex> _lock(fio->lock);
     memcpy(stbuf, &fio->st, sizeof(struct stat));
     return 0;
 }
@@ -70,7 +114,7 @@ static void hello_ll_getattr(fuse_req_t req, fuse_ino_t ino,
     if (hello_stat(ino, &stbuf) == -1)
         fuse_reply_err(req, ENOENT);
     else
-        fuse_reply_attr(req, &stbuf, 1.0);
+        fuse_reply_attr(req, &stbuf, options.attr_timeout);
 }
 
 static void hello_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
@@ -80,82 +124,117 @@ static void hello_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
         return;
     }
     uint64_t id = 0;
-    if (!repli->get(parent, name, id)) {
-        fuse_reply_err(req, ENOENT);
+    if (!repli->lookup(parent, name, id)) {
+        if (options.negative_timeout > 0) {
+            // the kernel keeps a negative dentry, creates through this mount replace it
+            e.ino = 0;
+            e.entry_timeout = options.negative_timeout;
+            fuse_reply_entry(req, &e);
+        } else {
+            fuse_reply_err(req, ENOENT);
+        }
         return;
     }
-
-    if (hello_stat(id, &e.attr) == 0) {
+    // the entry reply is a lookup the kernel holds until it forgets the inode
+    auto fio = repli->acquire_fio(id, 1, 0);
+    if (fio != nullptr) {
+        {
+            std::unique_lock<std::mutex> _lock(fio->lock);
+            e.attr = fio->st;
+        }
         e.ino = e.attr.st_ino;
-        e.attr_timeout = 1.0;
-        e.entry_timeout = 1.0;
+        e.attr_timeout = options.attr_timeout;
+        e.entry_timeout = options.entry_timeout;
         fuse_reply_entry(req, &e);
         return;
     }
     fuse_reply_err(req, ENOENT);
 }
 
-struct dirbuf {
-    char *p;
-    size_t size;
-};
-
-static void dirbuf_add(fuse_req_t req, struct dirbuf *b, const char *name,
-                       fuse_ino_t ino) {
-    struct stat stbuf{0};
-    size_t oldsize = b->size;
-    b->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
-    b->p = (char *) realloc(b->p, b->size);
-
-    stbuf.st_ino = ino;
-    fuse_add_direntry(req, b->p + oldsize, b->size - oldsize, name, &stbuf,
-                      b->size);
-}
-
-#define min(x, y) ((x) < (y) ? (x) : (y))
-
-static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-                             off_t off, size_t maxsize) {
-    if (off < bufsize)
-        return fuse_reply_buf(req, buf + off,
-                              min(bufsize - off, maxsize));
-    else
-        return fuse_reply_buf(req, NULL, 0);
-}
-
-static void hello_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-                             off_t off, struct fuse_file_info *fi) {
-    (void) fi;
+/// shared by readdir and readdirplus: an entry's offset is the cookie of its name so a
+/// reply can be resumed after the last entry the kernel consumed (see DirectoryState::seek)
+static void repli_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                          off_t off, struct fuse_file_info *fi, bool plus) {
     if (!repli) {
         fuse_reply_err(req, ENOMEM);
         return;
     }
     // TODO: check if ino is a directory
-    if (fi->fh) {
-        replifs::DirectoryState *d = (replifs::DirectoryState *) (void *) (fi->fh);
-        //filler(buf, ".", NULL, 0);
-        //filler(buf, "..", NULL, 0);
-        thread_local std::string dir_data; // Eventually there will be no allocations
-        dir_data.clear();
-        size_t dsize = dir_data.size();
-        size_t todo = size - off;
-        size_t found = 0;
-        for (; d->valid() && todo; d->next()) {
-            size_t oldsize = dir_data.size();
-            std::cout << "dir entry " << d->current_name() << std::endl;
-            dsize += fuse_add_direntry(req, NULL, 0, d->current_name(), NULL, 0);
-            dir_data.resize(dsize);
-            auto fio = repli->get_repli_fio(d->current_id());
-            if (fio) {
-                fuse_add_direntry(req, &dir_data[oldsize], dsize - oldsize, d->current_name(), &fio->st, dsize);
-            }
-            --todo;
-            ++found;
+    if (!fi->fh) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    replifs::DirectoryState *d = (replifs::DirectoryState *) (void *) (fi->fh);
+    thread_local std::string dir_data; // Eventually there will be no allocations
+    thread_local std::vector<std::string> names;
+    thread_local std::vector<uint64_t> ids;
+    thread_local std::vector<uint64_t> offsets;
+    thread_local std::vector<struct stat> stats;
+    names.clear();
+    ids.clear();
+    offsets.clear();
+
+    // the entry sizes only depend on the names, so the page is known before any stat is read
+    size_t used = 0;
+    for (d->seek(off); d->valid(); d->next()) {
+        const char *name = d->current_name();
+        size_t esize = plus ? fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0)
+                            : fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+        if (used + esize > size) {
+            break;
+        }
+        used += esize;
+        names.push_back(name);
+        ids.push_back(d->current_id());
+        offsets.push_back(d->remember());
+    }
+    // every entry of a readdirplus reply is a lookup the kernel forgets later
+    repli->get_repli_stats(ids, stats, plus ? 1 : 0);
+
+    dir_data.resize(used);
+    size_t at = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (stats[i].st_ino == 0) {
+            continue; // removed since it was listed
+        }
+        struct fuse_entry_param e{0};
+        e.attr = stats[i];
+        if (plus) {
+            e.ino = e.attr.st_ino;
+            e.attr_timeout = options.attr_timeout;
+            e.entry_timeout = options.entry_timeout;
+            at += fuse_add_direntry_plus(req, &dir_data[at], used - at, names[i].c_str(), &e, offsets[i]);
+        } else {
+            at += fuse_add_direntry(req, &dir_data[at], used - at, names[i].c_str(), &e.attr, offsets[i]);
         }
-        reply_buf_limited(req, dir_data.data(), dir_data.size(), off, size);
-    } else {
-        reply_buf_limited(req, NULL, 0, 0, 0);
     }
+    fuse_reply_buf(req, dir_data.data(), at);
+}
+
+static void repli_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    if (repli) {
+        repli->forget(ino, nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+static void repli_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    if (repli) {
+        for (size_t i = 0; i < count; ++i) {
+            repli->forget(forgets[i].ino, forgets[i].nlookup);
+        }
+    }
+    fuse_reply_none(req);
+}
+
+static void hello_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t off, struct fuse_file_info *fi) {
+    repli_readdir(req, ino, size, off, fi, false);
+}
+
+static void repli_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t off, struct fuse_file_info *fi) {
+    repli_readdir(req, ino, size, off, fi, true);
 }
 
 static void hello_ll_open(fuse_req_t req, fuse_ino_t ino,
@@ -167,18 +246,18 @@ static void hello_ll_open(fuse_req_t req, fuse_ino_t ino,
         if (fi->fh) {
             return EBADF;
         }
-        replifs::File *fio = repli->get_repli_fio(ino);
+        struct timespec current_time;
+        if (clock_gettime(CLOCK_REALTIME, &current_time)) {
+            return ENOMEM;
+        }
+        // keeps the inode in the table until release
+        replifs::File *fio = repli->acquire_fio(ino, 0, 1);
         if (!fio) {
             return ENOENT;// TODO: really invalid path
         }
         fi->fh = reinterpret_cast<uint64_t>(fio);
-        uint64_t id = fio->st.st_ino;
-
 
-        struct timespec current_time;
-        if (clock_gettime(CLOCK_REALTIME, &current_time)) {
-            return ENOMEM;
-        }
+        std::unique_lock<std::mutex> _lock(fio->lock);
         fio->st.st_atime = current_time.tv_sec;
         fio->st.st_atimensec = current_time.tv_nsec;
         return 0;
@@ -198,34 +277,80 @@ static void hello_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
         if (!fi->fh) {
             return EBADF;
         }
-        size_t len;
         replifs::File *fio = (replifs::File *) (void *) fi->fh;
         if (!fio) {
             return ENOMEM;
         }
-        if (size + _offset > fio->st.st_size) {
-            return EFAULT;
+        uint64_t id;
+        nst::access_hint hint = nst::access_normal;
+        {
+            std::unique_lock<std::mutex> _lock(fio->lock);
+            // the writeback cache reads whole pages, past the end is a short read
+            if (_offset >= fio->st.st_size) {
+                size = 0;
+            } else {
+                size = std::min<uint64_t>(size, fio->st.st_size - _offset);
+            }
+            id = fio->st.st_ino;
+            // blocks of a streaming read are not kept in the page cache at the expense of others
+            if (_offset > 0 && (uint64_t) _offset == fio->read_end) {
+                hint = nst::access_sequential;
+            }
+            fio->read_end = _offset + size;
+        }
+        if (size == 0) {
+            fuse_reply_buf(req, nullptr, 0);
+            return 0;
         }
-        fio->rbuf.resize(size);
-        char *pbuf = &fio->rbuf[0];
+        const uint64_t BS = REPLI_BLOCKSIZE;
         uint64_t offset = _offset;
         uint64_t remaining = size;
-        const uint64_t BS = REPLI_BLOCKSIZE;
+        size_t count = (offset % BS + size + BS - 1) / BS;
+        // the kernel reads straight out of the pinned block buffers - they are released after the reply
+        thread_local replifs::resources::Pinned pins;
+        thread_local std::vector<std::pair<replifs::resources::Identity, uint64_t>> blocks;
+        // fuse_bufvec has a variable length buf array, backed here by whole fuse_bufvec sized units:
+        // the header holds buf[0], the count - 1 bufs after it are rounded up to whole units
+        thread_local std::vector<fuse_bufvec> bufv_data;
+        blocks.clear();
+        for (size_t b = 0; b < count; ++b) {
+            blocks.emplace_back(id, offset / BS + b + replifs::Constants::DATA_OFFSET);
+        }
+        // the blocks are looked up in one pass, each from the leaf of the one before
+        if (!repli->get_pinned(blocks, pins, hint)) {
+            pins.clear();
+            return EIO;
+        }
+        bufv_data.resize((sizeof(fuse_bufvec) + (count - 1) * sizeof(fuse_buf) + sizeof(fuse_bufvec) - 1) /
+                         sizeof(fuse_bufvec));
+        fuse_bufvec *bufv = bufv_data.data();
+        bufv->count = count;
+        bufv->idx = 0;
+        bufv->off = 0;
+        size_t at = 0;
         while (remaining) {// this loop will sometimes read block by block
             uint64_t ipos = offset % BS;
-            uint64_t block = offset / BS;
 
             uint64_t todo = std::min<uint64_t>(BS - ipos, remaining);
             assert(ipos + todo <= BS);
-            if (!repli->get_raw(fio->st.st_ino, block + replifs::Constants::DATA_OFFSET, ipos, pbuf, todo)) {
+            auto &pinned = pins[at];
+            if (!pinned || pinned->size() < ipos + todo) {
+                pins.clear();
                 return EIO;
             }
+            fuse_buf &buf = bufv->buf[at++];
+            buf.size = todo;
+            buf.flags = (fuse_buf_flags) 0;
+            buf.mem = &(*pinned)[ipos];
+            buf.fd = -1;
+            buf.pos = 0;
             assert(remaining + todo > remaining);
             remaining -= todo;
-            pbuf += todo;
             offset += todo;
         }
-        fuse_reply_buf(req, &fio->rbuf[0], size);
+        assert(at == count);
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        pins.clear();
         return 0;
     };
 
@@ -236,12 +361,11 @@ static void hello_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 
 static void repli_opendir(fuse_req_t req, fuse_ino_t ino,
                           struct fuse_file_info *fi) {
-    auto dir = repli->get_dir();
-    auto fio = repli->get_repli_fio(ino);
-    if (!fio) {
+    if (!repli->hold_fio(ino)) {
         fuse_reply_err(req, ENOENT);
         return;
     }
+    auto dir = repli->get_dir();
     dir->open(ino);
     fi->fh = reinterpret_cast<uint64_t>(dir);
     fuse_reply_open(req, fi);
@@ -261,10 +385,11 @@ static void repli_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_in
 
 static void repli_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int valid, struct fuse_file_info *fi) {
     auto setattr = [&]() -> int {
-        replifs::File *fio = repli->get_repli_fio(ino);
+        auto fio = repli->hold_fio(ino);
         if (!fio) {
             return ENOENT;// TODO: really invalid path
         }
+        std::unique_lock<std::mutex> _lock(fio->lock);
         if (valid & FUSE_SET_ATTR_MODE) {
             fio->st.st_mode = attr->st_mode;
         }
@@ -285,11 +410,13 @@ static void repli_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int
             fio->st.st_mtimensec = attr->st_mtimensec;
             fio->st.st_mtime = attr->st_mtime;
         }
-        auto r = repli->set(fio->st); /// update changes
+        struct stat st = fio->st;
+        _lock.unlock();
+        auto r = repli->set(st); /// update changes
         if (!r) {
             return EIO;
         }
-        fuse_reply_attr(req, &fio->st, 1.0);
+        fuse_reply_attr(req, &st, options.attr_timeout);
         return 0;
     };
     int r = setattr();
@@ -330,8 +457,7 @@ static int repli_mknod(uint64_t context, const char *name, mode_t mode, dev_t de
     auto cr = repli->create(context, name, id, nullptr, 0);
     if (cr.first) {
         repli->set(st);
-        replifs::File *fio = repli->get_repli_fio(id);
-        if (!fio) {
+        if (!repli->hold_fio(id)) {
             return ENOENT;// TODO: really invalid path
         }
         return 0;
@@ -350,11 +476,14 @@ static void repli_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mod
     struct fuse_entry_param e{0};
 
     int r = repli_mknod(parent, name, mode, rdev, st);
+    if (r == 0 && repli->acquire_fio(st.st_ino, 1, 0) == nullptr) {
+        r = ENOENT;
+    }
     if (r == 0) {
         e.attr = st;// more typesafe in c++ if it fails then struct stat != struct stat
         e.ino = e.attr.st_ino;
-        e.attr_timeout = 1.0;
-        e.entry_timeout = 1.0;
+        e.attr_timeout = options.attr_timeout;
+        e.entry_timeout = options.entry_timeout;
         fuse_reply_entry(req, &e);
     } else {
         fuse_reply_err(req, r);
@@ -370,24 +499,75 @@ static void repli_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
         fuse_reply_err(req, ENOMEM);
         return;
     }
-    if (!repli->remove(parent, name)) {
+    if (!repli->unlink(parent, name)) {
         fuse_reply_err(req, ENOENT);
     } else {
         fuse_reply_err(req, 0);
     }
 }
 
+/// the file type bits of an inode, 0 if it does not exist
+static mode_t file_type(uint64_t ino) {
+    auto fio = repli->hold_fio(ino);
+    if (!fio) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> _lock(fio->lock);
+    return fio->st.st_mode & S_IFMT;
+}
+
 static void repli_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
-    repli_unlink(req, parent, name);
+    if (repli == nullptr) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    uint64_t id = 0;
+    if (!repli->get(parent, name, id)) {
+        fuse_reply_err(req, ENOENT);
+    } else if (file_type(id) != S_IFDIR) {
+        fuse_reply_err(req, ENOTDIR);
+    } else if (!repli->empty(id)) {
+        fuse_reply_err(req, ENOTEMPTY);
+    } else {
+        repli_unlink(req, parent, name);
+    }
 }
 
 static void
-repli_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname) {
+repli_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname,
+             unsigned int flags) {
     auto rename = [&]() -> int {
         uint64_t id = 0;
+        if (flags & ~RENAME_NOREPLACE) {
+            return EINVAL; // no RENAME_EXCHANGE or RENAME_WHITEOUT
+        }
+        if ((flags & RENAME_NOREPLACE) && repli->get(newparent, newname, id)) {
+            return EEXIST;
+        }
         if (!repli->get(parent, name, id)) {
             return ENOENT;
         }
+        uint64_t replaced = 0;
+        if (repli->get(newparent, newname, replaced)) {
+            if (replaced == id) {
+                return 0; // both names link the same inode
+            }
+            // a directory only replaces an empty directory and anything else only a non directory
+            const bool dir = file_type(id) == S_IFDIR;
+            const bool replaced_dir = file_type(replaced) == S_IFDIR;
+            if (dir && !replaced_dir) {
+                return ENOTDIR;
+            }
+            if (!dir && replaced_dir) {
+                return EISDIR;
+            }
+            if (replaced_dir && !repli->empty(replaced)) {
+                return ENOTEMPTY;
+            }
+            if (!repli->unlink(newparent, newname)) { // the replaced inode loses a link
+                return EIO;
+            }
+        }
         if (!repli->remove(parent, name)) {
             return EIO;
         }
@@ -405,44 +585,93 @@ repli_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t new
 }
 
 static void repli_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    struct fuse_entry_param e{0};
     auto link = [&]() -> int {
-
+        uint64_t id = 0;
+        if (repli->get(newparent, newname, id)) {
+            return EEXIST;
+        }
+        // the entry reply is a lookup like the one of hello_ll_lookup
+        replifs::File *fio = repli->acquire_fio(ino, 1, 0);
+        if (!fio) {
+            return ENOENT;
+        }
         if (!repli->create(newparent, newname, ino, nullptr, 0).first) {
+            repli->forget(ino, 1);
             return EIO;
         }
+        {
+            std::unique_lock<std::mutex> _lock(fio->lock);
+            ++fio->st.st_nlink;
+            e.attr = fio->st;
+        }
+        if (!repli->set(e.attr)) {
+            repli->forget(ino, 1);
+            return EIO;
+        }
+        e.ino = e.attr.st_ino;
+        e.attr_timeout = options.attr_timeout;
+        e.entry_timeout = options.entry_timeout;
         return 0;
     };
     int r = link();
     if (r != 0) {
         fuse_reply_err(req, r);
     } else {
-        fuse_reply_err(req, 0);
+        fuse_reply_entry(req, &e);
     }
 }
 
-static int storage_write(fuse_ino_t ino, const char *buf, size_t size, off_t _offset) {
+/// fill(into, todo) produces the next todo bytes of the write straight into the block buffer,
+/// fio is held by the caller for the length of the write
+template<typename _FillFunction>
+static int storage_write(replifs::File *fio, size_t size, off_t _offset, _FillFunction &&fill) {
     if (!repli)
         return ENOMEM;
-    replifs::File *fio = nullptr;
-    fio = repli->get_repli_fio(ino);
-
     if (!fio) {
         return ENOENT;
     }
+    std::unique_lock<std::mutex> _lock(fio->lock);
+    const uint64_t ino_id = fio->st.st_ino;
+    const uint64_t BS = REPLI_BLOCKSIZE;
+    uint64_t offset = fio->st.st_size;
+    uint64_t remaining = 0;
+    auto no_data = [](size_t, char *, size_t) -> bool { return true; };
     if (_offset > fio->st.st_size) {
-        return EFAULT;
+        // the writeback cache may flush pages out of order so the gap up to the write
+        // is zero filled, extending blocks never overwrites data written meanwhile
+        remaining = _offset - offset;
     }
-    const char *ibuf = buf;
-    uint64_t offset = _offset;
-    uint64_t remaining = size;
-    const uint64_t BS = REPLI_BLOCKSIZE;
     struct timespec current_time;
     if (clock_gettime(CLOCK_REALTIME, &current_time)) {
         return EFAULT;
     }
     fio->st.st_mtime = current_time.tv_sec;
     fio->st.st_mtimensec = current_time.tv_nsec;
+    _lock.unlock(); // the block writes below are serialized by the storage
+
+    // blocks are written in batches, each block starts from the leaf of the one before
+    thread_local std::vector<replifs::resources::Mutation> mutations;
+    const size_t GAP_BATCH = 256;
+    mutations.clear();
+    while (remaining) {
+        uint64_t ipos = offset % BS;
+        uint64_t block = offset / BS;
+
+        uint64_t todo = std::min<uint64_t>(BS - ipos, remaining);
+        mutations.push_back({ino_id, block + replifs::Constants::DATA_OFFSET, 0, ipos + todo});
+        remaining -= todo;
+        offset += todo;
+        if (mutations.size() == GAP_BATCH || remaining == 0) {
+            if (!repli->set_anon_fill(mutations, no_data)) {
+                return EIO;
+            }
+            mutations.clear();
+        }
+    }
 
+    offset = _offset;
+    remaining = size;
     while (remaining) {// this loop will sometimes read then write block by block
 
         uint64_t ipos = offset % BS;
@@ -451,15 +680,19 @@ static int storage_write(fuse_ino_t ino, const char *buf, size_t size, off_t _of
         uint64_t todo = std::min<uint64_t>(BS - ipos, remaining);
         assert(ipos + todo <= BS);
 
-        if (!repli->set_anon_raw(fio->st.st_ino, block + replifs::Constants::DATA_OFFSET, ibuf, todo, ipos)) {
-            return EIO;
-        }
+        mutations.push_back({ino_id, block + replifs::Constants::DATA_OFFSET, todo, ipos});
         assert(remaining + todo > remaining);
         remaining -= todo;
-        ibuf += todo;
         offset += todo;
     }
 
+    if (!repli->set_anon_fill(mutations, [&](size_t, char *into, size_t todo) -> bool {
+        return fill(into, todo);
+    })) {
+        return EIO;
+    }
+
+    _lock.lock();
     fio->st.st_size = std::max<size_t>(fio->st.st_size, _offset + size);
     //auto r = repli->set(fio); /// update changes
     //if(!r){
@@ -471,23 +704,76 @@ static int storage_write(fuse_ino_t ino, const char *buf, size_t size, off_t _of
 static void repli_write
         (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t _offset, struct fuse_file_info *fi
         ) {
-    replifs::File *fio = nullptr;
-    if (!fi->fh) {
-        fio = repli->get_repli_fio(ino);
+    // without a handle the File is held for the request, an open handle already holds it
+    auto held = repli->hold_fio(fi->fh ? 0 : ino);
+    replifs::File *fio = fi->fh ? (replifs::File *) (void *) fi->fh : held.get();
+
+    if (!fio) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+
+    const char *ibuf = buf;
+    int r = storage_write(fio, size, _offset, [&ibuf](char *into, size_t todo) -> bool {
+        memcpy(into, ibuf, todo);
+        ibuf += todo;
+        return true;
+    });
+
+    if (r == 0) {
+        {
+            std::unique_lock<std::mutex> _lock(fio->lock);
+            fio->st.st_size = std::max<size_t>(fio->st.st_size, _offset + size);
+        }
+        fuse_reply_write(req, size);
     } else {
-        fio = (replifs::File *) (void *) fi->fh;
+        fuse_reply_err(req, r);
     }
+}
+
+/// the request data may still be in the fuse pipe (FUSE_CAP_SPLICE_READ), it is read out
+/// before the write so the block buffers are filled from memory while the storage is locked
+static void repli_write_buf
+        (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t _offset, struct fuse_file_info *fi
+        ) {
+    auto held = repli->hold_fio(fi->fh ? 0 : ino);
+    replifs::File *fio = fi->fh ? (replifs::File *) (void *) fi->fh : held.get();
 
     if (!fio) {
         fuse_reply_err(req, EBADF);
         return;
     }
 
-
-    int r = storage_write(ino, buf, size, _offset);
+    size_t size = fuse_buf_size(bufv);
+    thread_local std::vector<char> staged;
+    struct fuse_bufvec staged_bufv = FUSE_BUFVEC_INIT(size);
+    bool in_pipe = false;
+    for (size_t i = bufv->idx; i < bufv->count; ++i) {
+        in_pipe = in_pipe || (bufv->buf[i].flags & FUSE_BUF_IS_FD) != 0;
+    }
+    if (in_pipe) {
+        staged.resize(size);
+        staged_bufv.buf[0].mem = staged.data();
+        if (fuse_buf_copy(&staged_bufv, bufv, (fuse_buf_copy_flags) 0) != (ssize_t) size) {
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        staged_bufv.idx = 0;
+        staged_bufv.off = 0;
+        bufv = &staged_bufv;
+    }
+    int r = storage_write(fio, size, _offset, [bufv](char *into, size_t todo) -> bool {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(todo);
+        dst.buf[0].mem = into;
+        // fuse_buf_copy advances bufv so the next block continues where this one stopped
+        return fuse_buf_copy(&dst, bufv, (fuse_buf_copy_flags) 0) == (ssize_t) todo;
+    });
 
     if (r == 0) {
-        fio->st.st_size = std::max<size_t>(fio->st.st_size, _offset + size);
+        {
+            std::unique_lock<std::mutex> _lock(fio->lock);
+            fio->st.st_size = std::max<size_t>(fio->st.st_size, _offset + size);
+        }
         fuse_reply_write(req, size);
     } else {
         fuse_reply_err(req, r);
@@ -496,12 +782,8 @@ static void repli_write
 
 static void repli_flush(fuse_req_t req, fuse_ino_t ino,
                         struct fuse_file_info *fi) {
-    replifs::File *fio = nullptr;
-    if (!fi->fh) {
-        fio = repli->get_repli_fio(ino);
-    } else {
-        fio = (replifs::File *) (void *) fi->fh;
-    }
+    auto held = repli->hold_fio(fi->fh ? 0 : ino);
+    replifs::File *fio = fi->fh ? (replifs::File *) (void *) fi->fh : held.get();
 
     if (!fio) {
         fuse_reply_err(req, EBADF);
@@ -509,21 +791,28 @@ static void repli_flush(fuse_req_t req, fuse_ino_t ino,
     }
 
     auto r = repli->set(fio); /// update changes
-    if (!r) {
+    if (!r || !repli->sync()) {
         fuse_reply_err(req, EIO);
         return;
     }
     fuse_reply_err(req, 0);
 }
 
+/// like flush, all changes are durable after the group commit it waits for
+static void repli_fsync(fuse_req_t req, fuse_ino_t ino, int /*datasync*/,
+                        struct fuse_file_info *fi) {
+    repli_flush(req, ino, fi);
+}
+
+static void repli_fsyncdir(fuse_req_t req, fuse_ino_t /*ino*/, int /*datasync*/,
+                           struct fuse_file_info * /*fi*/) {
+    fuse_reply_err(req, repli->sync() ? 0 : EIO);
+}
+
 static void repli_release(fuse_req_t req, fuse_ino_t ino,
                           struct fuse_file_info *fi) {
-    replifs::File *fio = nullptr;
-    if (!fi->fh) {
-        fio = repli->get_repli_fio(ino);
-    } else {
-        fio = (replifs::File *) (void *) fi->fh;
-    }
+    auto held = repli->hold_fio(fi->fh ? 0 : ino);
+    replifs::File *fio = fi->fh ? (replifs::File *) (void *) fi->fh : held.get();
 
     if (!fio) {
         fuse_reply_err(req, EBADF);
@@ -531,6 +820,9 @@ static void repli_release(fuse_req_t req, fuse_ino_t ino,
     }
 
     auto s = repli->set(fio); /// update changes
+    if (fi->fh) {
+        repli->release_fio(ino);
+    }
     if (!s) {
         fuse_reply_err(req, EIO);
         return;
@@ -568,14 +860,14 @@ static void repli_create(fuse_req_t req, fuse_ino_t parent, const char *name,
     struct stat st{0};
     int r = repli_mknod(parent, name, mode, 0, st);
     if (r == 0) {
-        auto fio = repli->get_repli_fio(st.st_ino);
+        auto fio = repli->acquire_fio(st.st_ino, 1, 1);
         if (fio) {
             fi->fh = (uint64_t) (void *) fio;
             fuse_entry_param e{0};
             e.attr = st;// more typesafe in c++ if it fails then struct stat != struct stat
             e.ino = e.attr.st_ino;
-            e.attr_timeout = 1.0;
-            e.entry_timeout = 1.0;
+            e.attr_timeout = options.attr_timeout;
+            e.entry_timeout = options.entry_timeout;
             fuse_reply_create(req, &e, fi);
         } else {
             fuse_reply_err(req, ENOENT);
@@ -587,13 +879,35 @@ static void repli_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 void repli_init(void *userdata, struct fuse_conn_info *conn) {
     using namespace replifs;
+    // let fuse_reply_data splice the pinned read buffers instead of coalescing them
+    // and hand write data to write_buf while it is still in the fuse pipe
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE | FUSE_CAP_SPLICE_READ);
+    if (options.writeback) {
+        conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+    }
+    // readdirplus answers ls -l without a lookup per entry
+    conn->want |= conn->capable & (FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
     repli = std::make_shared<replifs::resources>();
+    repli->graph.set_commit_policy(std::chrono::milliseconds(options.commit_window), options.commit_ops);
+    repli->graph.set_compaction_rate(std::max(0, options.compact_rate) * 1024ull);
+    repli->graph.set_cache_size(std::max(0, options.cache_size) * 1024ull * 1024ull);
+    repli->graph.set_cache_policy((nst::cache_policy) options.cache_policy);
+    repli->inodes.set_idle_limit(std::max(0, options.inode_cache));
+    repli->negative.set_timeout(std::max(0.0, options.negative_timeout));
+    repli->inode_reclaimed = [](const struct stat &st) {
+        const uint64_t BS = REPLI_BLOCKSIZE;
+        for (uint64_t block = 0; block < (st.st_size + BS - 1) / BS; ++block) {
+            repli->remove(st.st_ino, block + replifs::Constants::DATA_OFFSET);
+        }
+    };
 }
 
 static struct fuse_lowlevel_ops hello_ll_oper = {
         .lookup        = hello_ll_lookup,
+        .forget     = repli_forget,
         .getattr    = hello_ll_getattr,
         .readdir    = hello_ll_readdir,
+        .readdirplus = repli_readdirplus,
         .open        = hello_ll_open,
         .read        = hello_ll_read,
         .opendir    = repli_opendir,
@@ -606,37 +920,72 @@ static struct fuse_lowlevel_ops hello_ll_oper = {
         .rename     = repli_rename,
         .link       = repli_link,
         .write      = repli_write,
+        .write_buf  = repli_write_buf,
         .flush      = repli_flush,
+        .fsync      = repli_fsync,
+        .fsyncdir   = repli_fsyncdir,
         .release    = repli_release,
         .statfs     = repli_statfs,
         .access     = repli_access,
         .create     = repli_create,
+        .forget_multi = repli_forget_multi,
         .init       = repli_init,
 };
 
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    struct fuse_chan *ch;
-    char *mountpoint;
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
     int err = -1;
 
-    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
-        (ch = fuse_mount(mountpoint, &args)) != NULL) {
-        struct fuse_session *se;
-
-        se = fuse_lowlevel_new(&args, &hello_ll_oper,
-                               sizeof(hello_ll_oper), NULL);
+    if (fuse_opt_parse(&args, &options, repli_opts, NULL) == -1) {
+        return 1;
+    }
+    if (fuse_parse_cmdline(&args, &opts) != 0) {
+        return 1;
+    }
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        printf("    -o attr_timeout=T      cache timeout for attributes (%.0f secs)\n"
+               "    -o entry_timeout=T     cache timeout for names (%.0f secs)\n"
+               "    -o no_writeback        disable the kernel writeback cache\n"
+               "    -o commit_window=MS    changes are committed together within (%d ms)\n"
+               "    -o commit_ops=N        or once this many are pending (%d)\n"
+               "    -o compact_rate=KIB    data moved per second to shrink the file, 0 disables (%d KiB)\n"
+               "    -o cache_size=MIB      decoded pages kept across transactions (%d MiB)\n"
+               "    -o cache_lru           evict decoded pages least recently used first instead of 2Q\n"
+               "    -o inode_cache=N       inodes kept that the kernel does not reference (%d)\n"
+               "    -o negative_timeout=T  cache timeout for names that do not exist, 0 disables (%.0f secs)\n"
+               "    the long default timeouts assume this mount is the only writer of the data store,\n"
+               "    lower them if anything else changes it\n",
+               options.attr_timeout, options.entry_timeout, options.commit_window, options.commit_ops,
+               options.compact_rate, options.cache_size, options.inode_cache, options.negative_timeout);
+        err = 0;
+    } else if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        err = 0;
+    } else if (opts.mountpoint == NULL) {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+    } else {
+        se = fuse_session_new(&args, &hello_ll_oper,
+                              sizeof(hello_ll_oper), NULL);
         if (se != NULL) {
             if (fuse_set_signal_handlers(se) != -1) {
-                fuse_session_add_chan(se, ch);
-                err = fuse_session_loop(se);
+                if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                    fuse_daemonize(opts.foreground);
+                    // multithreaded unless -s is given on the command line
+                    err = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+                    fuse_session_unmount(se);
+                }
                 fuse_remove_signal_handlers(se);
-                fuse_session_remove_chan(ch);
             }
             fuse_session_destroy(se);
         }
-        fuse_unmount(mountpoint, ch);
     }
+    free(opts.mountpoint);
     fuse_opt_free_args(&args);
 
     return err ? 1 : 0;
@@ -10,22 +10,325 @@
 #include <iostream>
 #include <sstream>
 #include <unordered_map>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <algorithm>
+#include <chrono>
 
 
 #include "../storage/BTGraphDB.h"
+#include "../storage/clock_cache.h"
 
 namespace replifs {
 
     struct Constants {
         enum {
             STAT_OFFSET = 0,
-            DATA_OFFSET = 8
+            DATA_OFFSET = 8,
+            MAX_COOKIES = 4096
         };
     };
     struct File {
         std::string data;
-        std::string rbuf;
         struct stat st{0};
+        // where the previous read ended, a read starting there continues a sequential scan
+        uint64_t read_end{0};
+        // guards st and read_end - fuse worker threads may update the same file concurrently
+        mutable std::mutex lock;
+    };
+
+    /**
+     * the File of every inode in use, in shards that lock independently. an inode stays while
+     * the kernel holds lookups on it or has it open, unreferenced inodes are kept up to a limit
+     * and dropped least recently used first - their File is only valid for the request that
+     * got it
+     */
+    class inode_table {
+    private:
+        enum {
+            SHARDS = 64
+        };
+        typedef std::list<uint64_t> _Idle;
+        struct entry {
+            File file;
+            uint64_t lookups{0};
+            uint64_t opens{0};
+            // the last link is gone, the inode is reclaimed with its last reference
+            bool unlinked{false};
+            _Idle::iterator idle;
+        };
+        typedef std::unordered_map<uint64_t, std::unique_ptr<entry>> _Entries;
+        struct shard {
+            std::mutex lock;
+            _Entries entries;
+            _Idle idle; // unreferenced inodes, most recently used first
+        };
+        shard shards[SHARDS];
+        size_t idle_limit{65536};
+
+        shard &at(uint64_t ino) {
+            return shards[(ino * 0x9E3779B97F4A7C15ull >> 32) % SHARDS];
+        }
+
+        static bool referenced(const entry &e) {
+            return e.lookups > 0 || e.opens > 0;
+        }
+
+        /// adds references, an inode that gains its first one leaves the idle list
+        void acquire(shard &s, entry &e, uint64_t lookups, uint64_t opens) {
+            bool was = referenced(e);
+            e.lookups += lookups;
+            e.opens += opens;
+            if (!was && referenced(e)) {
+                s.idle.erase(e.idle);
+            } else if (!was) {
+                s.idle.splice(s.idle.begin(), s.idle, e.idle);
+            }
+        }
+
+        /**
+         * puts an inode that lost its last reference on the idle list
+         * @return true if it was unlinked, it is dropped and gone holds its attributes
+         */
+        bool unreferenced(shard &s, _Entries::iterator f, struct stat &gone) {
+            entry &e = *f->second;
+            if (referenced(e)) return false;
+            if (e.unlinked) {
+                gone = e.file.st;
+                s.entries.erase(f);
+                return true;
+            }
+            s.idle.push_front(f->first);
+            e.idle = s.idle.begin();
+            trim(s);
+            return false;
+        }
+
+        void trim(shard &s) {
+            while (s.idle.size() > std::max<size_t>(1, idle_limit / SHARDS)) {
+                s.entries.erase(s.idle.back());
+                s.idle.pop_back();
+            }
+        }
+
+        /// finds or loads an inode and calls use(File &) while it cannot be dropped
+        template<typename _Load, typename _Use>
+        bool visit(uint64_t ino, uint64_t lookups, uint64_t opens, _Load &&load, _Use &&use) {
+            auto &s = at(ino);
+            {
+                std::unique_lock<std::mutex> _lock(s.lock);
+                auto f = s.entries.find(ino);
+                if (f != s.entries.end()) {
+                    acquire(s, *f->second, lookups, opens);
+                    use(f->second->file);
+                    return true;
+                }
+            }
+            struct stat st{0};
+            if (!load(st)) { // without holding the lock
+                return false;
+            }
+            std::unique_lock<std::mutex> _lock(s.lock);
+            auto &published = s.entries[ino]; // the first thread to publish wins
+            if (published == nullptr) {
+                published = std::make_unique<entry>();
+                published->file.st = st;
+                s.idle.push_front(ino);
+                published->idle = s.idle.begin();
+                acquire(s, *published, lookups, opens);
+                use(published->file);
+                trim(s);
+            } else {
+                acquire(s, *published, lookups, opens);
+                use(published->file);
+            }
+            return true;
+        }
+
+    public:
+        /**
+         * the File of an inode with lookups and opens added to its references
+         * @param load load(struct stat &) reads the attributes of an inode that is not in the
+         * table, it is called without holding a lock
+         * @return nullptr if the inode is not in the table and could not be loaded
+         */
+        template<typename _Load>
+        File *get(uint64_t ino, uint64_t lookups, uint64_t opens, _Load &&load) {
+            File *r = nullptr;
+            visit(ino, lookups, opens, load, [&](File &f) { r = &f; });
+            return r;
+        }
+
+        /// copies the attributes of an inode, these stay valid when the inode is dropped
+        template<typename _Load>
+        bool get_stat(uint64_t ino, uint64_t lookups, struct stat &st, _Load &&load) {
+            return visit(ino, lookups, 0, load, [&](File &f) {
+                std::unique_lock<std::mutex> _lock(f.lock);
+                st = f.st;
+            });
+        }
+
+        /**
+         * drops n lookups the kernel no longer holds
+         * @return true if an unlinked inode lost its last reference, gone holds its attributes
+         */
+        bool forget(uint64_t ino, uint64_t n, struct stat &gone) {
+            auto &s = at(ino);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            auto f = s.entries.find(ino);
+            if (f == s.entries.end() || f->second->lookups == 0) return false;
+            f->second->lookups -= std::min(n, f->second->lookups);
+            return unreferenced(s, f, gone);
+        }
+
+        /// a handle from an open is released, returns like forget
+        bool close(uint64_t ino, struct stat &gone) {
+            auto &s = at(ino);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            auto f = s.entries.find(ino);
+            if (f == s.entries.end() || f->second->opens == 0) return false;
+            --f->second->opens;
+            return unreferenced(s, f, gone);
+        }
+
+        /**
+         * the last link of an inode was removed
+         * @return true if nothing references it and it can be reclaimed now, otherwise that
+         * happens when forget or close drop the last reference
+         */
+        bool unlink(uint64_t ino) {
+            auto &s = at(ino);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            auto f = s.entries.find(ino);
+            if (f == s.entries.end()) return true;
+            if (referenced(*f->second)) {
+                f->second->unlinked = true;
+                return false;
+            }
+            s.idle.erase(f->second->idle);
+            s.entries.erase(f);
+            return true;
+        }
+
+        /// drops an unreferenced inode so it is read again when it is next used
+        void erase(uint64_t ino) {
+            auto &s = at(ino);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            auto f = s.entries.find(ino);
+            if (f == s.entries.end() || referenced(*f->second)) return;
+            s.idle.erase(f->second->idle);
+            s.entries.erase(f);
+        }
+
+        /// the most unreferenced inodes kept
+        void set_idle_limit(size_t limit) {
+            idle_limit = limit;
+            for (auto &s : shards) {
+                std::unique_lock<std::mutex> _lock(s.lock);
+                trim(s);
+            }
+        }
+
+        size_t size() {
+            size_t r = 0;
+            for (auto &s : shards) {
+                std::unique_lock<std::mutex> _lock(s.lock);
+                r += s.entries.size();
+            }
+            return r;
+        }
+    };
+
+    /**
+     * names known not to exist under a directory, so repeated probes for missing names (include
+     * paths, sys.path) do not search the graph. adding a name drops its entry, a generation per
+     * shard keeps a lookup that raced with the add from remembering the name as missing
+     */
+    class negative_entries {
+    private:
+        typedef std::chrono::steady_clock _Clock;
+        enum {
+            SHARDS = 16,
+            SHARD_ENTRIES = 4096
+        };
+        struct shard {
+            std::mutex lock;
+            clock_cache<std::string, _Clock::time_point> entries{SHARD_ENTRIES};
+            uint64_t generation{0};
+        };
+        shard shards[SHARDS];
+        _Clock::duration timeout{0};
+
+        static const std::string &key(uint64_t parent, const char *name) {
+            thread_local std::string k;
+            k.assign((const char *) &parent, sizeof(parent));
+            k.append(name);
+            return k;
+        }
+
+        shard &at(const std::string &k) {
+            return shards[std::hash<std::string>()(k) % SHARDS];
+        }
+
+    public:
+        /// how long a missing name is remembered, 0 disables the cache
+        void set_timeout(double seconds) {
+            timeout = std::chrono::duration_cast<_Clock::duration>(std::chrono::duration<double>(seconds));
+            clear();
+        }
+
+        /// true if name is known not to exist under parent
+        bool contains(uint64_t parent, const char *name) {
+            if (timeout == _Clock::duration::zero()) return false;
+            auto &k = key(parent, name);
+            auto &s = at(k);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            auto expires = s.entries.find(k);
+            if (expires == nullptr) return false;
+            if (*expires < _Clock::now()) {
+                s.entries.erase(k);
+                return false;
+            }
+            return true;
+        }
+
+        /// taken before the graph is searched and passed to insert
+        uint64_t generation(uint64_t parent, const char *name) {
+            auto &k = key(parent, name);
+            auto &s = at(k);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            return s.generation;
+        }
+
+        /// remembers a missing name unless a name was added to its shard since generation
+        void insert(uint64_t parent, const char *name, uint64_t generation) {
+            if (timeout == _Clock::duration::zero()) return;
+            auto &k = key(parent, name);
+            auto &s = at(k);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            if (s.generation != generation) return;
+            s.entries.insert(k, _Clock::now() + timeout);
+        }
+
+        /// a name was added, called after the graph has it
+        void erase(uint64_t parent, const char *name) {
+            auto &k = key(parent, name);
+            auto &s = at(k);
+            std::unique_lock<std::mutex> _lock(s.lock);
+            ++s.generation;
+            s.entries.erase(k);
+        }
+
+        void clear() {
+            for (auto &s : shards) {
+                std::unique_lock<std::mutex> _lock(s.lock);
+                ++s.generation;
+                s.entries.clear();
+            }
+        }
     };
 
     struct Paths {
@@ -71,6 +374,13 @@ namespace replifs {
         typedef replifs::GraphDB::_Identity _Identity;
         size_t alloc{0};
         uint64_t current{0};
+        _Identity dir{0};
+        uint64_t after{0}; // cookie of the entry before si, 0 at the start
+        // names of the entries handed out recently, a readdir resumes after one of these.
+        // past MAX_COOKIES the oldest is forgotten first
+        std::unordered_map<uint64_t, std::string> cookies;
+        std::unordered_map<std::string, uint64_t> named;
+        std::deque<uint64_t> remembered;
         const char *empty_string{""};
         replifs::GraphDB::NumberNode number;
         replifs::GraphDB::Node text;
@@ -101,16 +411,89 @@ namespace replifs {
                 return ok;
             });
             name.clear();
-            if (ok)
-                graph->move(si, data.id, name);
+            if (ok) {
+                open(data.id);
+            }
             return r;
         }
 
         bool open(uint64_t id) {
             replifs::GraphDB::_Key name;
+            dir = id;
+            after = 0;
+            cookies.clear();
+            named.clear();
+            remembered.clear();
             return graph->move(si, id, name);
         }
 
+        /// the directory offset of an entry, a 63 bit FNV-1a hash of its name so that it
+        /// stays valid while other entries are added or removed
+        static uint64_t cookie(const char *name) {
+            uint64_t h = 14695981039346656037ull;
+            for (; *name; ++name) {
+                h ^= (uint8_t) *name;
+                h *= 1099511628211ull;
+            }
+            h &= 0x7FFFFFFFFFFFFFFFull; // off_t is signed
+            return h ? h : 1;
+        }
+
+        /// the cookie of the current entry, remembered so that a seek to it is a lower bound
+        uint64_t remember() {
+            const char *name = current_name();
+            auto n = named.find(name);
+            if (n != named.end()) {
+                return n->second;
+            }
+            if (remembered.size() >= Constants::MAX_COOKIES) {
+                auto oldest = cookies.find(remembered.front());
+                named.erase(oldest->second);
+                cookies.erase(oldest);
+                remembered.pop_front();
+            }
+            uint64_t c = cookie(name);
+            // a name whose hash is taken gets the next free cookie so it resumes at its own entry
+            while (cookies.count(c)) {
+                c = (c + 1) & 0x7FFFFFFFFFFFFFFFull;
+                c = c ? c : 1;
+            }
+            cookies[c] = name;
+            named[name] = c;
+            remembered.push_back(c);
+            return c;
+        }
+
+        /// positions si at the entry following the one with cookie off. sequential reads
+        /// continue in place, remembered cookies seek to the first name after theirs, which
+        /// also holds when that name was removed, and only unknown cookies have to scan the
+        /// directory
+        bool seek(uint64_t off) {
+            if (off == after) {
+                return valid();
+            }
+            if (off == 0) {
+                graph->move(si, dir, "");
+                after = 0;
+                return valid();
+            }
+            auto c = cookies.find(off);
+            if (c != cookies.end()) {
+                graph->seek(si, dir, c->second, false);
+            } else {
+                for (graph->move(si, dir, ""); si.valid() && cookie(current_name()) != off; si.next());
+                if (si.valid()) {
+                    si.next();
+                } else {
+                    // the entry was removed and its name forgotten, listing it again from the
+                    // start repeats entries instead of losing the rest
+                    graph->move(si, dir, "");
+                }
+            }
+            after = off;
+            return valid();
+        }
+
         bool open(const char *path) {
             auto context = path2id(path);
             return context > 0; //si.valid(); // if the fs is empty this will be false
@@ -137,6 +520,9 @@ namespace replifs {
         }
 
         void next() {
+            if (si.valid()) {
+                after = remember();
+            }
             si.next();
         }
     };
@@ -147,11 +533,14 @@ namespace replifs {
         typedef replifs::GraphDB::Node Name;
         typedef replifs::GraphDB::NumberNode Number;
         typedef GraphDB::_Identity Identity;
-
-        typedef std::unordered_map<uint64_t, std::shared_ptr<File>> _Statmap;
-        typedef std::unordered_map<std::string, uint64_t> _Namemap;
-        _Namemap name_data;
-        _Statmap stat_data;
+        typedef GraphDB::NumberMutation Mutation;
+        typedef std::vector<std::shared_ptr<nst::buffer_type>> Pinned;
+
+        typedef std::function<void(const struct stat &)> _InodeReclaimed;
+        // guards the directory states below (not the graph or the inodes which lock themselves)
+        std::mutex lock;
+        inode_table inodes;
+        negative_entries negative;
         BlockData root_data;
         std::unordered_map<size_t, DirectoryStatePtr> dirs;
         std::vector<DirectoryStatePtr> unused_dirs;
@@ -159,6 +548,9 @@ namespace replifs {
         replifs::GraphDB graph{"./replifs_data"};
         size_t alloced{0};
         Identity root;
+        // set by the frontend to remove the data blocks of an unlinked inode once nothing
+        // references it, the attributes are removed here
+        _InodeReclaimed inode_reclaimed;
 
         resources() {
             if (!graph.opened()) {
@@ -185,10 +577,12 @@ namespace replifs {
                     root = root_data.id;
                 }
             }
-
+            // the kernel never forgets the root
+            acquire_fio(root, 1, 0);
         }
 
         DirectoryState *get_dir() {
+            std::unique_lock<std::mutex> _lock(lock);
             DirectoryStatePtr r;
             if (unused_dirs.empty()) {
                 r = std::make_shared<DirectoryState>(&graph, ++alloced);
@@ -202,6 +596,7 @@ namespace replifs {
 
         bool recycle_dir(DirectoryState *dir) {
             if (dir == nullptr) return false;
+            std::unique_lock<std::mutex> _lock(lock);
             if (dirs.count(dir->alloc)) {
                 unused_dirs.push_back(dirs[dir->alloc]);
                 dirs.erase(dir->alloc);
@@ -212,36 +607,195 @@ namespace replifs {
             return false;
         }
 
-        replifs::File *get_repli_fio(const uint64_t ino) {
-            replifs::File *r = nullptr;
+        /**
+         * the File of an inode, loading its attributes if it is not in the inode table
+         * @param lookups entry replies sent to the kernel for it, released by forget
+         * @param opens handles opened on it, released by release_fio
+         */
+        replifs::File *acquire_fio(const uint64_t ino, uint64_t lookups, uint64_t opens) {
             if (ino == 0)
-                return r;
-            std::shared_ptr<replifs::File> fio = stat_data[ino];
-            if (fio == nullptr) {
-                fio = std::make_shared<replifs::File>();
-                if (this->get(ino, Constants::STAT_OFFSET, (char *) &fio->st, sizeof(fio->st))) {
-                    stat_data[ino] = fio;
-                } else {
-                    return r;
+                return nullptr;
+            return inodes.get(ino, lookups, opens, [&](struct stat &st) {
+                return this->get(ino, Constants::STAT_OFFSET, (char *) &st, sizeof(st));
+            });
+        }
+
+        /// get(context, name, id) that remembers the names which do not exist
+        bool lookup(uint64_t context, const char *name, uint64_t &id) {
+            if (negative.contains(context, name)) {
+                return false;
+            }
+            uint64_t generation = negative.generation(context, name);
+            if (get(context, name, id)) {
+                return true;
+            }
+            negative.insert(context, name, generation);
+            return false;
+        }
+
+        /// true if no name is linked under the directory context
+        bool empty(uint64_t context) {
+            GraphDB::prefix_string_iterator si;
+            graph.move(si, context, "");
+            return !si.valid();
+        }
+
+        /// the handle opened through acquire_fio is closed
+        void release_fio(const uint64_t ino) {
+            struct stat gone{0};
+            if (inodes.close(ino, gone)) {
+                reclaim(gone);
+            }
+        }
+
+        /// an open reference on a File for the length of a request that has no file handle,
+        /// a concurrent unlink cannot reclaim the File while the request uses it
+        struct HeldFile {
+            resources *owner{nullptr};
+            uint64_t ino{0};
+            File *fio{nullptr};
+
+            HeldFile(resources *owner, uint64_t ino) : owner(owner), ino(ino) {
+                fio = owner->acquire_fio(ino, 0, 1);
+            }
+
+            HeldFile(const HeldFile &) = delete;
+
+            HeldFile &operator=(const HeldFile &) = delete;
+
+            ~HeldFile() {
+                if (fio != nullptr) {
+                    owner->release_fio(ino);
                 }
+            }
 
+            File *get() const {
+                return fio;
             }
-            r = fio.get();
-            return r;
+
+            File *operator->() const {
+                return fio;
+            }
+
+            explicit operator bool() const {
+                return fio != nullptr;
+            }
+        };
+
+        /// the File of an inode held until the result goes out of scope, ino 0 holds nothing
+        HeldFile hold_fio(const uint64_t ino) {
+            return HeldFile(this, ino);
+        }
+
+        /// the kernel dropped n lookups of an inode
+        void forget(const uint64_t ino, uint64_t n) {
+            struct stat gone{0};
+            if (inodes.forget(ino, n, gone)) {
+                reclaim(gone);
+            }
+        }
+
+        /// removes what is stored for an inode that has no links and no references
+        void reclaim(const struct stat &st) {
+            if (inode_reclaimed) {
+                inode_reclaimed(st);
+            }
+            remove(st.st_ino, Constants::STAT_OFFSET);
+        }
+
+        /**
+         * removes a name and one link of the inode it names, an inode without links is
+         * reclaimed immediately or, while it is looked up or open, with its last reference
+         */
+        bool unlink(uint64_t context, const char *name) {
+            uint64_t id = 0;
+            if (!get(context, name, id) || !remove(context, name)) {
+                return false;
+            }
+            struct stat st{0};
+            auto fio = hold_fio(id);
+            if (!fio) {
+                return true;
+            }
+            {
+                std::unique_lock<std::mutex> _lock(fio->lock);
+                if (S_ISDIR(fio->st.st_mode) || fio->st.st_nlink <= 1) {
+                    fio->st.st_nlink = 0;
+                } else {
+                    --fio->st.st_nlink;
+                }
+                st = fio->st;
+            }
+            if (st.st_nlink > 0) {
+                return set(st);
+            }
+            // the reference held here is the last one at the latest, dropping it reclaims the inode
+            inodes.unlink(id);
+            return true;
         }
 
-        replifs::File *get_repli_fio(const char *path) {
-            thread_local std::string p;
-            p = path;
-            uint64_t inode = name_data[p];
-            if (inode == 0) {
-                auto r = this->get(path, inode, nullptr, 0);
-                if (!r) {
-                    return nullptr;
+        /// copies the attributes of each ids[i] into stats[i], st_ino is 0 where there is no
+        /// file. the ones that are not in the inode table are read in key order
+        /// @param lookups added to each inode found, readdirplus entries count as lookups
+        void get_repli_stats(const std::vector<uint64_t> &ids, std::vector<struct stat> &stats,
+                             uint64_t lookups = 0) {
+            thread_local std::vector<std::pair<uint64_t, size_t>> sorted;
+            sorted.clear();
+            stats.assign(ids.size(), {});
+            for (size_t i = 0; i < ids.size(); ++i) {
+                if (ids[i] == 0) continue;
+                sorted.emplace_back(ids[i], i);
+            }
+            // (ino, STAT_OFFSET) keys sort by inode so neighbouring lookups share btree pages
+            std::sort(sorted.begin(), sorted.end());
+            thread_local std::vector<std::pair<Identity, uint64_t>> missing;
+            thread_local Pinned loaded;
+            thread_local BlockData block;
+            missing.clear();
+            for (auto &m : sorted) {
+                inodes.get_stat(m.first, lookups, stats[m.second], [&](struct stat &) {
+                    if (missing.empty() || missing.back().first != m.first) {
+                        missing.emplace_back(m.first, Constants::STAT_OFFSET);
+                    }
+                    return false;
+                });
+            }
+            if (missing.empty() || !get_pinned(missing, loaded)) return;
+            // the ones read in one pass are published like any other load
+            for (size_t i = 0; i < missing.size(); ++i) {
+                const uint64_t ino = missing[i].first;
+                auto m = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(ino, (size_t) 0));
+                for (; m != sorted.end() && m->first == ino; ++m) {
+                    inodes.get_stat(ino, lookups, stats[m->second], [&](struct stat &st) {
+                        auto &value = loaded[i];
+                        if (!value || !block.read((const char *) value->data(), value->size()) ||
+                            block.value.size() < sizeof(st)) {
+                            return false;
+                        }
+                        memcpy(&st, block.value.data(), sizeof(st));
+                        return true;
+                    });
                 }
-                name_data[p] = inode;
             }
-            return get_repli_fio(inode);
+            loaded.clear();
+        }
+
+        /// resolves a path every time, a rename may change the inode it names
+        HeldFile hold_fio(const char *path) {
+            uint64_t inode = 0;
+            if (!this->get(path, inode, nullptr, 0)) {
+                inode = 0;
+            }
+            return hold_fio(inode);
+        }
+
+        /// the File a path names with a handle opened on it, released by release_fio
+        replifs::File *open_fio(const char *path) {
+            uint64_t inode = 0;
+            if (!this->get(path, inode, nullptr, 0)) {
+                return nullptr;
+            }
+            return acquire_fio(inode, 0, 1);
         }
 
         struct _t_inner {
@@ -284,6 +838,17 @@ namespace replifs {
                 return graph.add_raw(context, 0, number, buf, size, intro_offset); // will overwrite
             }
 
+            template<typename _FillFunction>
+            bool set_anon_fill(GraphDB &graph, uint64_t context, uint64_t number, size_t size, size_t intro_offset,
+                               _FillFunction &&fill) {
+                return graph.fill_raw(context, 0, number, size, intro_offset, std::forward<_FillFunction>(fill));
+            }
+
+            template<typename _FillFunction>
+            bool set_anon_fill(GraphDB &graph, const std::vector<Mutation> &mutations, _FillFunction &&fill) {
+                return graph.fill_raw(mutations, std::forward<_FillFunction>(fill));
+            }
+
             bool set_anon(GraphDB &graph, uint64_t context, uint64_t number, const char *d, size_t dl) {
                 data.clear();
                 if (d)
@@ -403,6 +968,16 @@ namespace replifs {
                 return graph.by_number_raw(o, ol, offset, context, number);
             }
 
+            std::shared_ptr<nst::buffer_type> get_pinned(GraphDB &graph, uint64_t context, uint64_t number,
+                                                         nst::access_hint hint) {
+                return graph.by_number_pinned(context, number, hint);
+            }
+
+            bool get_pinned(GraphDB &graph, const std::vector<std::pair<Identity, uint64_t>> &keys, Pinned &values,
+                            nst::access_hint hint) {
+                return graph.by_number_pinned(keys, values, hint);
+            }
+
             bool get(GraphDB &graph, uint64_t context, uint64_t number, size_t offset, char *o, size_t ol) {
                 uint64_t id = 0, last_id = 0;
                 bool ok = true;
@@ -523,6 +1098,21 @@ namespace replifs {
             return local.set_anon_raw(graph, context, number, buf, size, intro_offset);
         }
 
+        /// writes size bytes at intro_offset, fill(into, size) produces them in place
+        template<typename _FillFunction>
+        bool set_anon_fill(uint64_t context, uint64_t number, size_t size, size_t intro_offset,
+                           _FillFunction &&fill) {
+            _t_inner &local = get_local();
+            return local.set_anon_fill(graph, context, number, size, intro_offset, std::forward<_FillFunction>(fill));
+        }
+
+        /// set_anon_fill for several blocks, fill(i, into, size) produces the bytes of mutations[i]
+        template<typename _FillFunction>
+        bool set_anon_fill(const std::vector<Mutation> &mutations, _FillFunction &&fill) {
+            _t_inner &local = get_local();
+            return local.set_anon_fill(graph, mutations, std::forward<_FillFunction>(fill));
+        }
+
         bool remove(uint64_t context, uint64_t number) {
             _t_inner &local = get_local();
             return local.remove(graph, context, number);
@@ -530,14 +1120,22 @@ namespace replifs {
 
         bool remove(uint64_t context, const char *name) {
             _t_inner &local = get_local();
-            return local.remove(graph, context, name);
+            uint64_t id = 0;
+            local.get(graph, context, name, id);
+            bool r = local.remove(graph, context, name);
+            if (r && id != 0) {
+                inodes.erase(id);
+            }
+            return r;
         }
 
         bool remove(const char *path) {
             _t_inner &local = get_local();
+            uint64_t id = 0;
+            this->get(path, id, nullptr, 0);
             bool r = local.remove(graph, path);
-            if (r) {
-                stat_data.erase(name_data[path]);
+            if (r && id != 0) {
+                inodes.erase(id);
             }
             return r;
         }
@@ -553,7 +1151,12 @@ namespace replifs {
 
         bool set(const File *fio) {
             if (!fio) return false;
-            return set(fio->st);
+            struct stat st;
+            {
+                std::unique_lock<std::mutex> _lock(fio->lock);
+                st = fio->st;
+            }
+            return set(st);
         }
 
         bool set(const char *path, const char *d, size_t dl) {
@@ -602,6 +1205,20 @@ namespace replifs {
             return local.get_raw(graph, context, number, offset, o, ol);
         }
 
+        /// the raw block at context, number - pinned for as long as the result is held
+        std::shared_ptr<nst::buffer_type> get_pinned(uint64_t context, uint64_t number,
+                                                     nst::access_hint hint = nst::access_normal) {
+            _t_inner &local = get_local();
+            return local.get_pinned(graph, context, number, hint);
+        }
+
+        /// the raw blocks at several context, number pairs, nullptr where one does not exist
+        bool get_pinned(const std::vector<std::pair<Identity, uint64_t>> &keys, Pinned &values,
+                        nst::access_hint hint = nst::access_normal) {
+            _t_inner &local = get_local();
+            return local.get_pinned(graph, keys, values, hint);
+        }
+
         bool get(uint64_t context, uint64_t number, std::string &o) {
             _t_inner &local = get_local();
             return local.get(graph, context, number, o);
@@ -609,22 +1226,33 @@ namespace replifs {
 
         std::pair<bool, uint64_t> create(const char *path, const char *d, size_t dl) {
             _t_inner &local = get_local();
-            return local.create(graph, path, d, dl);
+            auto r = local.create(graph, path, d, dl);
+            negative.clear(); // the parent of the name is not known here
+            return r;
         }
 
         std::pair<bool, uint64_t> create(const char *path, uint64_t cid, const char *d, size_t dl) {
             _t_inner &local = get_local();
-            return local.create(graph, path, cid, d, dl);
+            auto r = local.create(graph, path, cid, d, dl);
+            negative.clear();
+            return r;
         }
 
         std::pair<bool, uint64_t> create(uint64_t context, const char *name, uint64_t cid, const char *d, size_t dl) {
             _t_inner &local = get_local();
-            return local.create(graph, context, name, cid, d, dl);
+            auto r = local.create(graph, context, name, cid, d, dl);
+            negative.erase(context, name);
+            return r;
         }
 
         uint64_t create() {
             return graph.create();
         }
+
+        /// true once every change made before the call is on disk
+        bool sync() {
+            return graph.sync();
+        }
     };
 
 }
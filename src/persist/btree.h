@@ -39,6 +39,7 @@ Copyright (c) 2013-2022, Christiaan Pretorius
 #include <istream>
 #include <ostream>
 #include <memory>
+#include <string>
 #include <cstddef>
 #include <bitset>
 #include <cassert>
@@ -240,6 +241,109 @@ namespace persist {
         }*/
     };
 
+    /// how the sorted keys of a node are written to a page, by default through the storage
+    template<typename _Key>
+    struct key_coding {
+        static const bool front_coded = false;
+        enum {
+            restart = 1
+        };
+
+        template<typename _Storage>
+        static size_t size(_Storage &storage, const _Key * /*prev*/, const _Key &key) {
+            return storage.store_size(key);
+        }
+
+        template<typename _Storage, typename _Iterator>
+        static _Iterator write(_Storage &storage, _Iterator writer, _Iterator limit, const _Key * /*prev*/, const _Key &key) {
+            return storage.store(writer, limit, key);
+        }
+
+        template<typename _Storage, typename _Buffer, typename _Iterator>
+        static _Iterator read(_Storage &storage, const _Buffer &buffer, _Iterator reader, const _Key * /*prev*/, _Key &key) {
+            return storage.retrieve(buffer, reader, key);
+        }
+    };
+
+    /// strings are front coded: a key keeps only the part that differs from the key before
+    /// it, every restart-th key is written whole so a reader can start decoding there
+    template<>
+    struct key_coding<std::string> {
+        static const bool front_coded = true;
+        enum {
+            restart = 16
+        };
+
+        static size_t shared(const std::string *prev, const std::string &key) {
+            if (prev == nullptr) return 0;
+            size_t l = std::min(prev->size(), key.size());
+            return std::mismatch(key.begin(), key.begin() + l, prev->begin()).first - key.begin();
+        }
+
+        /// bytes used by key after prev, prev is nullptr at a restart point
+        template<typename _Storage>
+        static size_t size(_Storage &, const std::string *prev, const std::string &key) {
+            size_t p = shared(prev, key);
+            return storage::leb128::unsigned_size((nst::u32) p) +
+                   storage::leb128::unsigned_size((nst::u32) (key.size() - p)) + key.size() - p;
+        }
+
+        template<typename _Storage, typename _Iterator>
+        static _Iterator write(_Storage &, _Iterator writer, _Iterator /*limit*/, const std::string *prev, const std::string &key) {
+            size_t p = shared(prev, key);
+            writer = storage::leb128::write_unsigned(writer, p);
+            writer = storage::leb128::write_unsigned(writer, key.size() - p);
+            return std::copy(key.begin() + p, key.end(), writer);
+        }
+
+        template<typename _Storage, typename _Buffer, typename _Iterator>
+        static _Iterator read(_Storage &, const _Buffer &buffer, _Iterator reader, const std::string *prev, std::string &key) {
+            _Iterator end = buffer.end();
+            _Iterator start = reader;
+            size_t p = storage::leb128::read_unsigned64(reader, end);
+            size_t l = storage::leb128::read_unsigned64(reader, end);
+            if (reader == start || p > (prev == nullptr ? 0 : prev->size()) || (size_t) (end - reader) < l) {
+                print_err("bad format: invalid front coded key");
+                throw bad_format();
+            }
+            if (p > 0) {
+                key.assign(*prev, 0, p);
+            } else {
+                key.clear();
+            }
+            key.append(reader, reader + l);
+            return reader + l;
+        }
+    };
+
+    /**
+     * how the values of a surface node are written to a page, by default through the storage
+     * a coded type also reads the values of pages written before it was, with read_uncoded
+     */
+    template<typename _Data>
+    struct value_coding {
+        static const bool coded = false;
+
+        template<typename _Storage>
+        static size_t size(_Storage &storage, const _Data &value) {
+            return storage.store_size(value);
+        }
+
+        template<typename _Storage, typename _Iterator>
+        static _Iterator write(_Storage &storage, _Iterator writer, _Iterator limit, const _Data &value) {
+            return storage.store(writer, limit, value);
+        }
+
+        template<typename _Storage, typename _Buffer, typename _Iterator>
+        static _Iterator read(_Storage &storage, const _Buffer &buffer, _Iterator reader, _Data &value) {
+            return storage.retrieve(buffer, reader, value);
+        }
+
+        template<typename _Storage, typename _Buffer, typename _Iterator>
+        static _Iterator read_uncoded(_Storage &storage, const _Buffer &buffer, _Iterator reader, _Data &value) {
+            return storage.retrieve(buffer, reader, value);
+        }
+    };
 
     struct def_p_traits /// persist traits
     {
@@ -453,6 +557,12 @@ namespace persist {
         /// Fourth template parameter: interpolator if applicable
         typedef _Iterpolator key_interpolator;
 
+        /// how keys are written to pages
+        typedef key_coding<_Key> key_coder;
+
+        /// how values are written to surface pages
+        typedef value_coding<_Data> value_coder;
+
         /// Fifth template parameter: Allow duplicate keys in the B+ tree. Used to
         /// implement multiset and multimap.
         static const bool allow_duplicates = _Duplicates;
@@ -1645,6 +1755,11 @@ namespace persist {
 #endif
             }
 
+            /// the key that front coding of key k continues from, nullptr at a restart point
+            const key_type *key_before(int k) const {
+                return k % key_coder::restart ? &get_key(k - 1) : nullptr;
+            }
+
             /// decodes a page from given storage and buffer and puts it in slots
             /// the buffer type is expected to be some sort of vector although no strict
             /// checking is performedinterior_node
@@ -1663,18 +1778,27 @@ namespace persist {
                     throw bad_format();
                 }
                 (*this).set_occupants(occupants);
-                (*this).level = leb128::read_signed(reader);
-                if ((*this).level <= 0 || (*this).level > 128) {
-                    print_err("bad format: loading invalid level for interior node",this->level);
+                nst::i32 level = leb128::read_signed(reader);
+                const bool front_coded = level < 0;
+                if (front_coded) {
+                    level = -1 - level;
+                }
+                if (level <= 0 || level > 128 || (front_coded && !key_coder::front_coded)) {
+                    print_err("bad format: loading invalid level for interior node",level);
                     throw bad_format();
                 }
+                (*this).level = level;
                 (*this).set_version(version);
                 for (u16 k = 0; k <= interiorslotmax; ++k) {
                     childid[k] = NULL_REF;
                 }
                 //node::check_deleted();
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    reader = storage.retrieve(buffer, reader, _keys[k]);
+                    if (front_coded) {
+                        reader = key_coder::read(storage, buffer, reader, key_before(k), _keys[k]);
+                    } else {
+                        reader = storage.retrieve(buffer, reader, _keys[k]);
+                    }
                 }
                 for (u16 k = 0; k <= (*this).get_occupants(); ++k) {
                     stream_address sa = (stream_address) leb128::read_signed64(reader, buffer.end());
@@ -1708,9 +1832,11 @@ namespace persist {
                     throw bad_format();
                 }
                 using namespace persist::storage;
-                u32 storage_use = leb128::signed_size((*this).get_occupants()) + leb128::signed_size((*this).level);
+                // a negative level marks keys written by the key coder
+                const nst::i32 level = key_coder::front_coded ? -1 - (*this).level : (*this).level;
+                u32 storage_use = leb128::signed_size((*this).get_occupants()) + leb128::signed_size(level);
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    storage_use += storage.store_size(get_key(k));
+                    storage_use += key_coder::size(storage, key_before(k), get_key(k));
                     storage_use += leb128::signed_size(childid[k].get_where());
                 }
                 storage_use += leb128::signed_size(childid[(*this).get_occupants()].get_where());
@@ -1720,10 +1846,10 @@ namespace persist {
                 buffer_type::iterator writer = buffer.begin();
 
                 writer = leb128::write_signed(writer, (*this).get_occupants());
-                writer = leb128::write_signed(writer, (*this).level);
+                writer = leb128::write_signed(writer, level);
 
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    writer = storage.store(writer, limit, get_key(k));
+                    writer = key_coder::write(storage, writer, limit, key_before(k), get_key(k));
                 }
                 ptrdiff_t d = writer - buffer.begin();
                 for (u16 k = 0; k <= (*this).get_occupants(); ++k) {
@@ -1782,6 +1908,11 @@ namespace persist {
             /// Define a related allocator for the surface_node structs.
             /// typedef typename _Alloc::template rebind<surface_node>::other alloc_type;
             typedef typename std::allocator_traits<_Alloc>::template rebind_alloc<surface_node> alloc_type;
+
+            enum {
+                /// in the (negative) level of a page whose values were written by the value coder
+                CODED_VALUES = 0x100
+            };
             /// Double linked list pointers to traverse the leaves
 
             typename surface_node::ptr preceding;
@@ -2278,6 +2409,11 @@ namespace persist {
 
 
 
+            /// the key that front coding of key k continues from, nullptr at a restart point
+            const key_type *key_before(int k) const {
+                return k % key_coder::restart ? &get_key(k - 1) : nullptr;
+            }
+
             /// decodes a page into a exterior node using the provided buffer and storage instance/context
             /// TODO: throw an exception if checks fail
 
@@ -2297,11 +2433,14 @@ namespace persist {
                     throw bad_format();
                 }
                 (*this).set_occupants(occupants);
-                (*this).level = leb128::read_signed(reader);
-                if ((*this).level != 0) {
+                nst::i32 level = leb128::read_signed(reader);
+                const bool front_coded = level < 0;
+                const bool coded_values = level == -1 - CODED_VALUES;
+                if (level != 0 && level != -1 && !coded_values) {
                     print_err("bad format: invalid level for surface node");
                     throw bad_format();
                 }
+                (*this).level = 0;
                 //nst::i32 encoded_key_size = leb128::read_signed(reader);
                 //nst::i32 encoded_value_size = leb128::read_signed(reader);
                 (*this).set_version(version);
@@ -2327,7 +2466,11 @@ namespace persist {
                
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
                     key_type &key = get_key(k);
-                    reader = storage.retrieve(buffer, reader, key);
+                    if (front_coded) {
+                        reader = key_coder::read(storage, buffer, reader, key_before(k), key);
+                    } else {
+                        reader = storage.retrieve(buffer, reader, key);
+                    }
                 }
                 (*this).hashed = 0;
                 // if (encoded_value_size > 0) {
@@ -2337,7 +2480,11 @@ namespace persist {
                 
                 bool add_hash = (storage.is_readonly() && !(::persist::memory_low_state));
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    reader = storage.retrieve(buffer, reader, get_value(k));
+                    if (coded_values) {
+                        reader = value_coder::read(storage, buffer, reader, get_value(k));
+                    } else {
+                        reader = value_coder::read_uncoded(storage, buffer, reader, get_value(k));
+                    }
                     if (add_hash) {
                         //++((*this).hashed);/// only add hash cache when readonly
                         //loading_context->add_hash(self, k);
@@ -2372,8 +2519,10 @@ namespace persist {
                 //encoded_key_size = 0;
                 //encoded_value_size = 0;
 
+                // a negative level marks keys written by the key coder, with a flag for the values
+                const nst::i32 level = value_coder::coded ? -1 - CODED_VALUES : key_coder::front_coded ? -1 : 0;
                 ptrdiff_t storage_use = leb128::signed_size((*this).get_occupants());
-                storage_use += leb128::signed_size((*this).level);
+                storage_use += leb128::signed_size(level);
                 //storage_use += leb128::signed_size(encoded_key_size);
                 //storage_use += leb128::signed_size(encoded_value_size);
                 storage_use += leb128::signed_size(preceding.get_where());
@@ -2381,11 +2530,11 @@ namespace persist {
 
                 storage_use += sizeof(key_type) * (*this).allocated;
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    storage_use += storage.store_size(get_key(k));
+                    storage_use += key_coder::size(storage, key_before(k), get_key(k));
                 }
                 storage_use += sizeof(data_type) * (*this).allocated;
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    storage_use += storage.store_size(get_value(k));
+                    storage_use += value_coder::size(storage, get_value(k));
                 }
                 buffer.resize(storage_use);
                 if (buffer.size() != (size_t) storage_use) {
@@ -2394,7 +2543,7 @@ namespace persist {
                 }
                 buffer_type::iterator writer = buffer.begin();
                 writer = leb128::write_signed(writer, (*this).get_occupants());
-                writer = leb128::write_signed(writer, (*this).level);
+                writer = leb128::write_signed(writer, level);
                 //writer = leb128::write_signed(writer, encoded_key_size);
                 //writer = leb128::write_signed(writer, encoded_value_size);
                 writer = leb128::write_signed(writer, preceding.get_where());
@@ -2403,11 +2552,11 @@ namespace persist {
                 auto limit = buffer.end();
 
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    writer = storage.store(writer, limit, get_key(k));
+                    writer = key_coder::write(storage, writer, limit, key_before(k), get_key(k));
                 }
                 
                 for (u16 k = 0; k < (*this).get_occupants(); ++k) {
-                    writer = storage.store(writer, limit, get_value(k));
+                    writer = value_coder::write(storage, writer, limit, get_value(k));
                 }
 
                 ptrdiff_t d = writer - buffer.begin();
@@ -2818,6 +2967,9 @@ namespace persist {
             buffer_type::iterator reader = load_buffer.begin();
             leb128::read_signed(reader);
             level = leb128::read_signed(reader);
+            if (level < 0) { // coded keys, a surface page may have flags above its level
+                level = (-1 - level) % surface_node::CODED_VALUES;
+            }
 
             if (level == 0) { // its a safaas
                 typename surface_node::ptr s;
@@ -4364,6 +4516,7 @@ namespace persist {
                 get_storage()->get_boot_value(stats.last_surface_size, LAST_PAGE_SIZE);
                 stats.start_last_surface_size = stats.last_surface_size;
                 get_storage()->get_boot_value(stats.leaves, LEAF_NODES);
+                stats.start_leaves = stats.leaves;
                 get_storage()->get_boot_value(stats.interiornodes, INTERIOR_NODES);
             }
 
@@ -4472,6 +4625,17 @@ namespace persist {
         }
 
     private:
+        /// the slot for key in a surface node or -1 if the key belongs to another node
+        int hint_slot(const typename surface_node::ptr &surface, const key_type &key) const {
+            if (surface == NULL_REF) return -1;
+            int occupants = surface->get_occupants();
+            if (occupants == 0 || key_less(key, surface->get_key(0)) ||
+                key_less(surface->get_key(occupants - 1), key)) {
+                return -1;
+            }
+            return find_lower(surface.rget(), key);
+        }
+
         // *** Convenient Key Comparison Functions Generated From key_less
         /// True if a < b ? constructed from key_less()
         inline bool key_smaller(const key_type &a, const key_type b) const {
@@ -4540,8 +4704,8 @@ namespace persist {
                     stats.start_last_surface_size = stats.last_surface_size;
                 }
                 if (stats.start_leaves != stats.leaves) {
-                    get_storage()->set_boot_value(stats.start_leaves, LEAF_NODES);
-                    stats.start_leaves = stats.last_surface_size;
+                    get_storage()->set_boot_value(stats.leaves, LEAF_NODES);
+                    stats.start_leaves = stats.leaves;
                 }
                 if (stats.start_interiornodes != stats.interiornodes) {
                     get_storage()->set_boot_value(stats.interiornodes, INTERIOR_NODES);
@@ -5271,6 +5435,17 @@ namespace persist {
                    ? iterator(this, surface, slot) : end();
         }
 
+        /// Tries to locate a key in the surface node of hint first, a sorted batch of
+        /// lookups only descends from the root when a key is outside the node of the
+        /// one before. hint must come from the tree as it is now
+        iterator find(const iterator &hint, const key_type &key) {
+            typename surface_node::ptr surface = hint.get_current();
+            int slot = hint_slot(surface, key);
+            if (slot < 0) return find(key);
+            return (slot < surface->get_occupants() && key_equal(key, surface->get_key(slot)))
+                   ? iterator(this, surface, slot) : end();
+        }
+
         /// Tries to locate a key in the B+ tree and returns an constant iterator
         /// to the key/data slot if found. If unsuccessful it returns end().
         const_iterator find(const key_type &key) const {
@@ -5531,15 +5706,22 @@ namespace persist {
             return insert_start(key, data);
         }
 
-        /// Attempt to insert a key/data pair into the B+ tree. The iterator hint
-        /// is currently ignored by the B+ tree insertion routine.
-        inline iterator insert(iterator /* hint */, const pair_type &x) {
-            return insert_start(x.first, x.second).first;
+        /// Attempt to insert a key/data pair into the B+ tree. A key that exists
+        /// in the surface node of hint is found there without descending the tree
+        inline iterator insert(const iterator &hint, const pair_type &x) {
+            return insert2(hint, x.first, x.second);
         }
 
-        /// Attempt to insert a key/data pair into the B+ tree. The iterator hint is
-        /// currently ignored by the B+ tree insertion routine.
-        inline iterator insert2(iterator /* hint */, const key_type &key, const data_type &data) {
+        /// Attempt to insert a key/data pair into the B+ tree. A key that exists
+        /// in the surface node of hint is found there without descending the tree
+        inline iterator insert2(const iterator &hint, const key_type &key, const data_type &data) {
+            typename surface_node::ptr surface = hint.get_current();
+            int slot = hint_slot(surface, key);
+            if (!allow_duplicates && slot >= 0 && slot < surface->get_occupants() &&
+                key_equal(key, surface->get_key(slot))) {
+                surface.change();
+                return iterator(this, surface, slot);
+            }
             return insert_start(key, data).first;
         }
 
@@ -6594,11 +6776,13 @@ namespace persist {
                 last_surface = left;
             }
             right->set_occupants(0);
+            parent->setup_internal_keys();
             if(stats.leaves == 0){
-                print_err("total_leaf_error");
+                // stores written before the count was recorded have none
+                print_wrn("leaf count is behind the tree");
+            }else{
+                stats.leaves--;
             }
-            parent->setup_internal_keys();
-            stats.leaves--;
             //nodes_erased.insert(right->get_address());
             right.next_check();
             left.next_check();
@@ -323,6 +323,12 @@ namespace persist {
         iterator find(const key_type &key) {
             return tree.find(key);
         }
+
+        /// Tries to locate a key in the surface node of hint before descending
+        /// from the root, see btree::find
+        iterator find(const iterator &hint, const key_type &key) {
+            return tree.find(hint, key);
+        }
         /// Tries to locate a key in the B+ tree and returns a pointer to the
         /// key/data slot if found. If unsuccessful it returns nullptr.
 
@@ -468,15 +474,15 @@ namespace persist {
             return tree.insert2(key, data);
         }
 
-        /// Attempt to insert a key/data pair into the B+ tree. The iterator hint
-        /// is currently ignored by the B+ tree insertion routine.
-        inline iterator insert(iterator hint, const value_type &x) {
+        /// Attempt to insert a key/data pair into the B+ tree. A key that exists
+        /// in the surface node of hint is found there without descending the tree
+        inline iterator insert(const iterator &hint, const value_type &x) {
             return tree.insert2(hint, x.first, x.second);
         }
 
-        /// Attempt to insert a key/data pair into the B+ tree. The iterator hint is
-        /// currently ignored by the B+ tree insertion routine.
-        inline iterator insert2(iterator hint, const key_type &key, const data_type &data) {
+        /// Attempt to insert a key/data pair into the B+ tree. A key that exists
+        /// in the surface node of hint is found there without descending the tree
+        inline iterator insert2(const iterator &hint, const key_type &key, const data_type &data) {
             return tree.insert2(hint, key, data);
         }
 
@@ -6,9 +6,15 @@
 #define REPLIFS_BT_GRAPHDB_H
 
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 #include <string>
+#include <vector>
 #include <iostream>
 #include "transaction.h"
+#include "compactor.h"
 #include "memory_storage_alloc.h"
 #include "persist/storage/basic_storage.h"
 
@@ -54,6 +60,40 @@ namespace replifs {
         return vsize;
     }
 
+    /**
+     * order preserving variable length encoding of an unsigned integer: one byte counting
+     * the significant bytes followed by those bytes big endian. smaller values sort first
+     * and no encoding is a prefix of another
+     * @return the size of todo
+     */
+    inline size_t encode_ordered(std::string &todo, uint64_t value) {
+        uint8_t length = 0;
+        for (uint64_t v = value; v != 0; v >>= 8) {
+            ++length;
+        }
+        todo.push_back((char) length);
+        for (uint8_t i = length; i > 0; --i) {
+            todo.push_back((char) (uint8_t) (value >> ((i - 1) * 8)));
+        }
+        return todo.size();
+    }
+
+    /// @return the bytes read or 0 if temp does not hold a valid encoding at offset
+    inline size_t decode_ordered(uint64_t &r, const char *temp, size_t size, size_t offset) {
+        if (offset >= size) {
+            return 0;
+        }
+        uint8_t length = (uint8_t) temp[offset];
+        if (length > sizeof(uint64_t) || offset + 1 + length > size) {
+            return 0;
+        }
+        r = 0;
+        for (uint8_t i = 0; i < length; ++i) {
+            r = (r << 8) | (uint8_t) temp[offset + 1 + i];
+        }
+        return 1 + length;
+    }
+
     struct KeyTool {
         std::string temp;
 
@@ -76,22 +116,235 @@ namespace replifs {
 
     };
 
+    /**
+     * the value of a BtDb key, values up to INLINE_MAX bytes are kept in the tree leaf next
+     * to the key and larger ones in a buffer of their own at a logical address
+     */
+    struct BtValue {
+        enum {
+            INLINE_MAX = 256
+        };
+        // 0 while the value is inline
+        nst::u64 address{0};
+        std::string bytes;
+    };
+}
+
+namespace persist {
+    /// inline values are written as their size + 1 followed by the bytes, others as 0 and the address
+    template<>
+    struct value_coding<replifs::BtValue> {
+        static const bool coded = true;
+
+        template<typename _Storage>
+        static size_t size(_Storage &, const replifs::BtValue &value) {
+            if (value.address) {
+                size_t r = 2;
+                for (nst::u64 a = value.address >> 7; a != 0; a >>= 7) ++r;
+                return r;
+            }
+            return storage::leb128::unsigned_size((nst::u32) value.bytes.size() + 1) + value.bytes.size();
+        }
+
+        template<typename _Storage, typename _Iterator>
+        static _Iterator write(_Storage &, _Iterator writer, _Iterator /*limit*/, const replifs::BtValue &value) {
+            if (value.address) {
+                writer = storage::leb128::write_unsigned(writer, 0);
+                return storage::leb128::write_unsigned(writer, value.address);
+            }
+            writer = storage::leb128::write_unsigned(writer, value.bytes.size() + 1);
+            return std::copy(value.bytes.begin(), value.bytes.end(), writer);
+        }
+
+        template<typename _Storage, typename _Buffer, typename _Iterator>
+        static _Iterator read(_Storage &, const _Buffer &buffer, _Iterator reader, replifs::BtValue &value) {
+            _Iterator start = reader;
+            nst::u64 l = storage::leb128::read_unsigned64(reader, buffer.end());
+            if (reader == start) {
+                print_err("bad format: value missing");
+                throw bad_format();
+            }
+            value.bytes.clear();
+            if (l == 0) {
+                start = reader;
+                value.address = storage::leb128::read_unsigned64(reader, buffer.end());
+                if (reader == start || value.address == 0) {
+                    print_err("bad format: invalid value address");
+                    throw bad_format();
+                }
+                return reader;
+            }
+            if ((nst::u64) (buffer.end() - reader) < l - 1) {
+                print_err("bad format: value exceeds page");
+                throw bad_format();
+            }
+            value.address = 0;
+            value.bytes.append(reader, reader + (l - 1));
+            return reader + (l - 1);
+        }
+
+        /// pages written before values were inlined hold only addresses
+        template<typename _Storage, typename _Buffer, typename _Iterator>
+        static _Iterator read_uncoded(_Storage &storage, const _Buffer &buffer, _Iterator reader, replifs::BtValue &value) {
+            value.bytes.clear();
+            return storage.retrieve(buffer, reader, value.address);
+        }
+    };
+}
+
+namespace replifs {
     struct BtDb {
         //mutable memory_storage_alloc storage;
 
-        typedef persist::btree_map<std::string, nst::u64, nst::transaction> bt_t;
+        typedef persist::btree_map<std::string, BtValue, nst::transaction> bt_t;
         mutable nst::file_storage_alloc storage{"./bt_repli_data.dat"};
         mutable nst::transaction tx{&storage}; // tx constructs as started
         mutable bt_t data{tx};
+        // shrinks the file while the committer is otherwise idle
+        mutable nst::compactor compaction{&storage};
         mutable bt_t::iterator data_ptr;
         mutable bt_t::iterator update_ptr;
+        // the b-tree and transaction are not thread safe - all access is serialized here
+        mutable std::mutex lock;
+
+        // group commit: mutations are made durable together by the committer thread when
+        // the commit window since the first pending mutation passes or commit_ops are pending
+        std::chrono::milliseconds commit_window{10};
+        nst::u64 commit_ops{1024};
+        mutable nst::u64 written{0}; // sequence of the last mutation
+        mutable nst::u64 durable{0}; // sequence of the last mutation made durable
+        mutable bool urgent{false}; // someone is waiting in sync
+        mutable bool commit_ok{true};
+        bool stopping{false};
+        mutable std::condition_variable pending;
+        mutable std::condition_variable committed;
+        std::thread committer;
+        // how often an idle committer checks for compaction work
+        std::chrono::milliseconds compact_interval{100};
+
+        // the commit the committer is logging
+        mutable nst::file_storage_alloc::prepared_commit prepared;
+
+        // flush the tree and commit it together with all pending values in one transaction.
+        // the lock is released while the commit is logged and synched, mutations made
+        // meanwhile go to the next transaction
+        void commit_pending(std::unique_lock<std::mutex> &_lock) const {
+            nst::u64 upto = written;
+            data.flush();
+            bool ok = tx.prepare(prepared);
+            if (!tx.begin()) {
+                ok = false;
+            }
+            if (ok) {
+                _lock.unlock();
+                storage.log(prepared);
+                _lock.lock();
+                ok = storage.complete(prepared);
+            }
+            commit_ok = ok;
+            if (!commit_ok) {
+                print_err("group commit failed at", upto);
+            }
+            durable = upto;
+            urgent = urgent && written > durable;
+            committed.notify_all();
+        }
 
-        BtDb() {
+        // the tree has just been committed so the transaction holds no changes
+        void compact() const {
+            if (written == durable && !stopping) {
+                compaction.step(tx);
+            }
+        }
 
+        void run_committer() {
+            std::unique_lock<std::mutex> _lock(lock);
+            while (!stopping) {
+                if (written == durable) {
+                    if (compaction.get_rate() == 0) {
+                        pending.wait(_lock);
+                    } else if (pending.wait_for(_lock, compact_interval) == std::cv_status::timeout) {
+                        compact();
+                    }
+                    continue;
+                }
+                pending.wait_for(_lock, commit_window, [&]() -> bool {
+                    return stopping || urgent || written - durable >= commit_ops;
+                });
+                commit_pending(_lock);
+                compact();
+            }
+            if (written != durable) {
+                commit_pending(_lock);
+            }
+        }
+
+        // called with lock held after each mutation
+        void mutated() const {
+            if (++written - durable >= commit_ops) {
+                pending.notify_one();
+            } else if (written - durable == 1) {
+                pending.notify_one(); // opens the commit window
+            }
+        }
+
+        BtDb() {
+            committer = std::thread([this]() { run_committer(); });
         }
 
         BtDb(const char *) {
+            committer = std::thread([this]() { run_committer(); });
+        }
+
+        ~BtDb() {
+            {
+                std::unique_lock<std::mutex> _lock(lock);
+                stopping = true;
+                pending.notify_one();
+            }
+            committer.join();
+        }
 
+        /// the commit window and the number of pending mutations that ends it early
+        void set_commit_policy(std::chrono::milliseconds window, nst::u64 ops) {
+            std::unique_lock<std::mutex> _lock(lock);
+            commit_window = window;
+            commit_ops = std::max<nst::u64>(1, ops);
+        }
+
+        /// bytes per second the compactor may move, 0 disables it
+        void set_compaction_rate(nst::u64 bytes_per_second) {
+            std::unique_lock<std::mutex> _lock(lock);
+            compaction.set_rate(bytes_per_second);
+            pending.notify_one();
+        }
+
+        /// the most bytes of decoded pages kept across transactions
+        void set_cache_size(nst::u64 bytes) {
+            std::unique_lock<std::mutex> _lock(lock);
+            storage.get_pages().set_budget(bytes);
+        }
+
+        /// how decoded pages are evicted, changing it empties the page cache
+        void set_cache_policy(nst::cache_policy policy) {
+            std::unique_lock<std::mutex> _lock(lock);
+            storage.get_pages().set_policy(policy);
+        }
+
+        /// blocks until every mutation made before the call is durable, the waiters share
+        /// the next group commit instead of syncing on their own
+        bool sync() const {
+            std::unique_lock<std::mutex> _lock(lock);
+            nst::u64 target = written;
+            if (durable >= target) {
+                return commit_ok;
+            }
+            urgent = true;
+            pending.notify_one();
+            committed.wait(_lock, [&]() -> bool {
+                return durable >= target;
+            });
+            return commit_ok;
         }
 
         bool is_open() const {
@@ -106,51 +359,150 @@ namespace replifs {
             return storage.open(name);
         }
 
+        // drops the buffer of a value that is no longer kept at its address
+        void release(nst::u64 va) const {
+            if (va) {
+                auto &buff = tx.allocate(va, nst::storage_action::write);
+                buff.clear();
+                tx.complete();
+            }
+        }
+
         bool put(const std::string &k, const char *buf, size_t size, size_t intro_offset) {
-            update_ptr = data.insert(k, 0).first;
-            nst::u64 v_address = update_ptr.value();
+            return put_with(k, size, intro_offset, [buf](char *into, size_t todo) -> bool {
+                memcpy(into, buf, todo);
+                return true;
+            });
+        }
+
+        /// like put above but lets the caller produce the bytes straight into
+        /// the allocated value buffer, fill(into, size) returns false on failure
+        /// a zero size only extends the value to intro_offset if its shorter
+        template<typename _FillFunction>
+        bool put_with(const std::string &k, size_t size, size_t intro_offset, _FillFunction &&fill) {
+            std::unique_lock<std::mutex> _lock(lock);
+            update_ptr = data.insert(k, BtValue()).first;
+            bool r = fill_value(update_ptr.data(), size, intro_offset, fill);
+            mutated();
+            return r;
+        }
+
+        /// a write of size bytes at offset into the value of key
+        struct Mutation {
+            std::string key;
+            size_t size;
+            size_t offset;
+        };
+
+        /**
+         * put_with for several keys under one lock, fill(i, into, size) produces the bytes
+         * of mutations[i]. keys in ascending order let each one start from the leaf of the
+         * one before instead of the root
+         * @return false if a fill failed, the mutations after it are not applied
+         */
+        template<typename _FillFunction>
+        bool put_with(const std::vector<Mutation> &mutations, _FillFunction &&fill) {
+            std::unique_lock<std::mutex> _lock(lock);
+            for (size_t i = 0; i < mutations.size(); ++i) {
+                const Mutation &m = mutations[i];
+                update_ptr = i == 0 ? data.insert(m.key, BtValue()).first : data.insert2(update_ptr, m.key, BtValue());
+                bool r = fill_value(update_ptr.data(), m.size, m.offset, [&](char *into, size_t todo) -> bool {
+                    return fill(i, into, todo);
+                });
+                mutated();
+                if (!r) return false;
+            }
+            return true;
+        }
+
+    private:
+        // the body of put_with, called with lock held. a failed fill leaves the value its
+        // previous size
+        template<typename _FillFunction>
+        bool fill_value(BtValue &value, size_t size, size_t intro_offset, _FillFunction &&fill) {
+            if (value.address == 0 && intro_offset + size <= BtValue::INLINE_MAX) {
+                const size_t previous = value.bytes.size();
+                // an intro offset past the end leaves a zero filled gap
+                if (intro_offset + size > value.bytes.size()) {
+                    value.bytes.resize(intro_offset + size);
+                }
+                if (size == 0 || fill(&value.bytes[intro_offset], size)) {
+                    return true;
+                }
+                value.bytes.resize(previous);
+                return false;
+            }
+            nst::u64 v_address = value.address;
             auto action = v_address ? nst::storage_action::write : nst::storage_action::create;
 
             nst::buffer_type *buff = &tx.allocate(v_address, action);
+            if (!value.bytes.empty()) { // the value outgrew the leaf
+                buff->assign(value.bytes.begin(), value.bytes.end());
+                std::string().swap(value.bytes);
+            }
 
-            if (intro_offset + size < buff->size()) {
-                memcpy(&(*buff)[intro_offset], buf, size);
-            } else if (intro_offset > buff->size()) {
-                tx.complete();
-                print_err("invalid intro offset");
-                return false;
-            } else {
+            const size_t previous = buff->size();
+            // an intro offset past the end leaves a zero filled gap
+            if (intro_offset + size > buff->size()) {
                 if (buff->empty()) {
                     buff->reserve(1024ull * 32ull);
                 }
                 buff->resize(intro_offset + size);
-                memcpy(&(*buff)[intro_offset], buf, size);
+            }
+            bool r = size == 0 || fill((char *) &(*buff)[intro_offset], size);
+            if (!r) {
+                buff->resize(previous);
             }
 
-
-            update_ptr.data() = v_address;
+            value.address = v_address;
             tx.complete();
-            return true;
+            return r;
         }
 
+        // the pinned buffer of a value, called with lock held
+        std::shared_ptr<nst::buffer_type> pinned(const BtValue &value, nst::access_hint hint) const {
+            if (value.address == 0) {
+                return std::make_shared<nst::buffer_type>(value.bytes.begin(), value.bytes.end());
+            }
+            return tx.pin(value.address, hint);
+        }
+
+    public:
+
         bool put(const std::string &k, const std::string &v) {
-            update_ptr = data.insert(k, 0).first;
-            nst::u64 v_address = update_ptr.value();
+            std::unique_lock<std::mutex> _lock(lock);
+            update_ptr = data.insert(k, BtValue()).first;
+            BtValue &value = update_ptr.data();
+            if (v.size() <= BtValue::INLINE_MAX) {
+                release(value.address);
+                value.address = 0;
+                value.bytes = v;
+                mutated();
+                return true;
+            }
+            nst::u64 v_address = value.address;
             auto action = v_address ? nst::storage_action::write : nst::storage_action::create;
             auto &buff = tx.allocate(v_address, action);
             buff.clear();
             std::copy(v.begin(), v.end(), std::back_inserter(buff));
-            update_ptr.data() = v_address;
+            value.address = v_address;
+            std::string().swap(value.bytes);
             tx.complete();
+            mutated();
             return true;
         }
 
         bool get(const std::string &k, std::string &v) const {
+            std::unique_lock<std::mutex> _lock(lock);
             data_ptr = data.find(k);
             if (data_ptr == data.end()) return false;
-            nst::u64 va = data_ptr.data();
-            if (va == nst::u64()) v.clear();
-            auto &buff = tx.allocate(va, nst::storage_action::write);
+            const BtValue &value = data_ptr.data();
+            if (value.address == 0) {
+                v = value.bytes;
+                return true;
+            }
+            nst::u64 va = value.address;
+            auto &buff = tx.allocate(va, nst::storage_action::read);
             v.clear();
             std::copy(buff.begin(), buff.end(), std::back_inserter(v));
             tx.complete();
@@ -158,13 +510,20 @@ namespace replifs {
         }
 
         bool get(char *into, size_t size, size_t offset, const std::string &k) const {
+            std::unique_lock<std::mutex> _lock(lock);
             data_ptr = data.find(k);
             if (data_ptr == data.end()) return false;
-            nst::u64 va = data_ptr.data();
-            if (va == nst::u64()) {
-                return false;
-            };
-            auto &buff = tx.allocate(va, nst::storage_action::write);
+            const BtValue &value = data_ptr.data();
+            if (value.address == 0) {
+                if (value.bytes.size() < size + offset) {
+                    print_err("offset or size error");
+                    return false;
+                }
+                memcpy(into, &value.bytes[offset], size);
+                return true;
+            }
+            nst::u64 va = value.address;
+            auto &buff = tx.allocate(va, nst::storage_action::read);
             if (buff.size() < size + offset) {
                 print_err("offset or size error");
                 tx.complete();
@@ -175,64 +534,171 @@ namespace replifs {
             return true;
         }
 
-        bool remove(const std::string &k) const {
+        /**
+         * returns the value buffer of a key without copying it out of the transaction
+         * the buffer is pinned (unchanged by later writes) for as long as the pointer is held,
+         * inline values are copied into a buffer of their own
+         * @param k the key
+         * @param hint how the value is read, the tree nodes are always cached normally
+         * @return nullptr if the key does not exist
+         */
+        std::shared_ptr<nst::buffer_type> get_pinned(const std::string &k,
+                                                     nst::access_hint hint = nst::access_normal) const {
+            std::unique_lock<std::mutex> _lock(lock);
+            data_ptr = data.find(k);
+            if (data_ptr == data.end()) return nullptr;
+            return pinned(data_ptr.data(), hint);
+        }
+
+        /**
+         * get_pinned for several keys under one lock, values[i] is nullptr where keys[i] does
+         * not exist. keys in ascending order let each lookup start from the leaf of the one before
+         */
+        void get_pinned(const std::vector<std::string> &keys, std::vector<std::shared_ptr<nst::buffer_type>> &values,
+                        nst::access_hint hint = nst::access_normal) const {
+            std::unique_lock<std::mutex> _lock(lock);
+            values.assign(keys.size(), nullptr);
+            bool found = false;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                auto at = found ? data.find(data_ptr, keys[i]) : data.find(keys[i]);
+                if (at == data.end()) continue;
+                data_ptr = at;
+                found = true;
+                values[i] = pinned(data_ptr.data(), hint);
+            }
+        }
+
+        /// moves the value of a key to another key without copying it
+        bool rekey(const std::string &from, const std::string &to) {
+            std::unique_lock<std::mutex> _lock(lock);
+            data_ptr = data.find(from);
+            if (data_ptr == data.end()) return false;
+            BtValue value = data_ptr.data();
+            data.erase(from);
+            update_ptr = data.insert(to, BtValue()).first;
+            update_ptr.data() = value;
+            mutated();
+            return true;
+        }
+
+        /**
+         * moves the value of a key into the leaf if it is small enough
+         * @return true if the value was moved
+         */
+        bool make_inline(const std::string &k) {
+            std::unique_lock<std::mutex> _lock(lock);
             data_ptr = data.find(k);
             if (data_ptr == data.end()) return false;
-            nst::u64 va = data_ptr.data();
-            if (va) {
-                auto &buff = tx.allocate(va, nst::storage_action::write);
-                buff.clear();
-                tx.complete();
+            nst::u64 va = data_ptr.data().address;
+            if (va == 0) return false;
+            auto &buff = tx.allocate(va, nst::storage_action::read);
+            bool small = buff.size() <= BtValue::INLINE_MAX;
+            BtValue value;
+            if (small) {
+                value.bytes.assign(buff.begin(), buff.end());
             }
+            tx.complete();
+            if (!small) return false;
+            // found pages are not written back, the insert marks the page changed
+            update_ptr = data.insert(k, BtValue()).first;
+            update_ptr.data() = value;
+            release(va);
+            mutated();
+            return true;
+        }
+
+        /// true if there are no keys
+        bool empty() const {
+            std::unique_lock<std::mutex> _lock(lock);
+            return data.empty();
+        }
+
+        /// an external boot value of the storage, 0 if it was never set
+        nst::u64 get_boot(nst::u64 index) const {
+            std::unique_lock<std::mutex> _lock(lock);
+            nst::u64 r = 0;
+            tx.get_boot_value(r, index);
+            return r;
+        }
+
+        void set_boot(nst::u64 index, nst::u64 value) {
+            std::unique_lock<std::mutex> _lock(lock);
+            tx.set_boot_value(value, index);
+            mutated();
+        }
+
+        bool remove(const std::string &k) const {
+            std::unique_lock<std::mutex> _lock(lock);
+            data_ptr = data.find(k);
+            if (data_ptr == data.end()) return false;
+            release(data_ptr.data().address);
             data.erase(k);
+            mutated();
             return true;
         }
 
         struct iterator {
             bt_t *bt;
             nst::transaction *tx;
+            // the owning db's lock - iterators share the tree with all other callers
+            std::mutex *lock;
             bt_t::iterator iter;
+            std::string ekey;
             std::string eval;
 
-            iterator(bt_t *bt, nst::transaction *tx)
-                    : bt(bt), tx(tx) {
+            iterator(bt_t *bt, nst::transaction *tx, std::mutex *lock)
+                    : bt(bt), tx(tx), lock(lock) {
+                std::unique_lock<std::mutex> _lock(*lock);
                 iter = bt->begin();
             }
 
-            iterator(bt_t *bt, nst::transaction *tx, const std::string &lb)
-                    : bt(bt), tx(tx) {
+            iterator(bt_t *bt, nst::transaction *tx, std::mutex *lock, const std::string &lb)
+                    : bt(bt), tx(tx), lock(lock) {
+                std::unique_lock<std::mutex> _lock(*lock);
                 iter = bt->lower_bound(lb);
             }
 
             std::string &value() {
+                std::unique_lock<std::mutex> _lock(*lock);
                 eval.clear();
-                nst::u64 va = iter.data();
-                if (!va) return eval;
-                auto &buff = tx->allocate(va, nst::storage_action::write);
+                const BtValue &value = iter.data();
+                if (!value.address) {
+                    eval = value.bytes;
+                    return eval;
+                }
+                nst::u64 va = value.address;
+                auto &buff = tx->allocate(va, nst::storage_action::read);
                 std::copy(buff.begin(), buff.end(), std::back_inserter(eval));
                 tx->complete();
                 return eval;
             }
 
+            /// a copy of the current key which stays valid while other threads modify the tree
             std::string &key() {
-                return iter.key();
+                std::unique_lock<std::mutex> _lock(*lock);
+                ekey = iter.key();
+                return ekey;
             }
 
             bool next() {
+                std::unique_lock<std::mutex> _lock(*lock);
                 ++iter;
                 return iter != bt->end();
             }
 
             bool valid() {
+                std::unique_lock<std::mutex> _lock(*lock);
                 return iter != bt->end();
             }
 
             bool first() {
+                std::unique_lock<std::mutex> _lock(*lock);
                 iter = bt->begin();
                 return iter != bt->end();
             }
 
             bool move(const std::string &key) {
+                std::unique_lock<std::mutex> _lock(*lock);
                 iter = bt->find(key);
                 return iter != bt->end();
             }
@@ -243,11 +709,11 @@ namespace replifs {
         };
 
         std::shared_ptr<iterator> begin() const {
-            return std::make_shared<iterator>(&data, &tx);
+            return std::make_shared<iterator>(&data, &tx, &lock);
         }
 
         std::shared_ptr<iterator> lower_bound(const std::string &lb) const {
-            return std::make_shared<iterator>(&data, &tx, lb);
+            return std::make_shared<iterator>(&data, &tx, &lock, lb);
         }
     };
 
@@ -289,10 +755,15 @@ namespace replifs {
                 name.clear();
             }
 
-            const std::string &append_serialize(std::string &data) const {
+            /// the type and context, shared by every name in the context
+            const std::string &append_prefix(std::string &data) const {
+                data.push_back((char) (uint8_t) type);
+                encode_ordered(data, context);
+                return data;
+            }
 
-                encode(data, type);
-                encode(data, context);
+            const std::string &append_serialize(std::string &data) const {
+                append_prefix(data);
                 data.append(name);
                 return data;
             }
@@ -308,12 +779,16 @@ namespace replifs {
 
             bool read(const char *value, size_t size) {
                 clear();
-                if (size < sizeof(_Identity) + sizeof(type)) {
+                if (size < 2) {
                     return false;
                 }
-                size_t offset = 0;
-                offset += decode(type, value, size, offset);
-                offset += decode(context, value, size, offset);
+                type = (uint8_t) value[0];
+                size_t offset = 1;
+                size_t n = decode_ordered(context, value, size, offset);
+                if (n == 0) {
+                    return false;
+                }
+                offset += n;
                 name.clear();
                 name.append(value + offset, size - offset);
                 return true;
@@ -338,10 +813,16 @@ namespace replifs {
                 number = 0LL;
             }
 
+            /// the type and context, shared by every number in the context
+            const std::string &append_prefix(std::string &data) const {
+                data.push_back((char) (uint8_t) type);
+                encode_ordered(data, context);
+                return data;
+            }
+
             const std::string &append_serialize(std::string &data) const {
-                encode(data, type);
-                encode(data, context);
-                encode(data, number);
+                append_prefix(data);
+                encode_ordered(data, number);
                 return data;
             }
 
@@ -356,14 +837,17 @@ namespace replifs {
 
             bool read(const char *value, size_t size) {
                 clear();
-                if (size < sizeof(_Identity) + sizeof(type)) {
+                if (size < 3) {
                     return false;
                 }
-                size_t offset = 0;
-                offset += decode(type, value, size, offset);
-                offset += decode(context, value, size, offset);
-                offset += decode(number, value, size, offset);
-                return true;
+                type = (uint8_t) value[0];
+                size_t offset = 1;
+                size_t n = decode_ordered(context, value, size, offset);
+                if (n == 0) {
+                    return false;
+                }
+                offset += n;
+                return decode_ordered(number, value, size, offset) == size - offset;
             }
         };
 
@@ -443,7 +927,27 @@ namespace replifs {
             }
         };
 
+    public:
+        enum {
+            // boot value holding the format of the keys and values
+            FORMAT_BOOT = 16,
+            // fixed width type, context and number in keys, before the format was recorded
+            FORMAT_LEGACY = 0,
+            // one byte type and encode_ordered context and number
+            FORMAT_COMPACT_KEYS = 1,
+            // values up to BtValue::INLINE_MAX bytes are in the tree leaves
+            FORMAT_INLINE_VALUES = 2,
+            FORMAT = FORMAT_INLINE_VALUES
+        };
+
     private:
+        enum {
+            // identities a thread takes from the id node at a time
+            ID_LEASE = 4096,
+            // keys rewritten per migration step
+            MIGRATE_BATCH = 4096
+        };
+
         struct per_thread {
             Node temp_node{External, 0, ""};
             NumberNode temp_number{ExternalNumber, 0, 0};
@@ -452,6 +956,12 @@ namespace replifs {
             std::string temp_value;
             std::string temp_value_data;
             std::string temp_node_data;
+            std::vector<std::string> temp_keys;
+            std::vector<BtDb::Mutation> temp_mutations;
+            // identities [lease_next, lease_end) leased from the graph with this instance
+            uint64_t lease_instance{0};
+            _Identity lease_next{_Identity()};
+            _Identity lease_end{_Identity()};
         };
 
         per_thread &get_per_thread() {
@@ -460,7 +970,15 @@ namespace replifs {
         }
 
     private:
+        // guards the id node
         std::mutex lock;
+        // tells leases of a graph apart from those of an earlier one at the same address
+        const uint64_t instance{next_instance()};
+
+        static uint64_t next_instance() {
+            static std::atomic<uint64_t> instances{0};
+            return ++instances;
+        }
 
         std::string location;
         const Node id_node{Internal, 0, "id"};
@@ -469,13 +987,41 @@ namespace replifs {
         std::string id_value_data;
         std::string id_node_data;
         _DbType db;
+        // the keys are in the format this code reads
+        bool current{false};
 
     private:
 
         void open() {
             if (!db.open(location)) {
                 std::cerr << "could not open data store" << std::endl;
+                return;
             }
+            if (db.empty()) {
+                db.set_boot(FORMAT_BOOT, FORMAT);
+            }
+            current = db.get_boot(FORMAT_BOOT) == FORMAT;
+            if (!current) {
+                std::cerr << "data store format " << db.get_boot(FORMAT_BOOT) << " is not " << (int) FORMAT
+                          << ", run replifs_migrate on it first" << std::endl;
+            }
+        }
+
+        /**
+         * splits a key written before FORMAT_COMPACT_KEYS: a 4 byte type and 8 byte context
+         * followed by the name or an 8 byte number
+         */
+        static bool read_legacy(const std::string &k, uint32_t &type, _Identity &context, size_t &rest) {
+            if (k.size() < sizeof(type) + sizeof(context) || k[0] != 0 || k[1] != 0 || k[2] != 0) {
+                return false;
+            }
+            decode(type, k.data(), k.size(), 0);
+            decode(context, k.data(), k.size(), sizeof(type));
+            rest = sizeof(type) + sizeof(context);
+            if (type == ExternalNumber) {
+                return k.size() == rest + sizeof(_NumberKey);
+            }
+            return type == External || type == Internal;
         }
 
         bool close() {
@@ -494,7 +1040,141 @@ namespace replifs {
         }
 
         bool opened() const {
-            return db.is_open();
+            return db.is_open() && current;
+        }
+
+        /// the format recorded in the store
+        uint64_t format() const {
+            return db.get_boot(FORMAT_BOOT);
+        }
+
+    private:
+        /**
+         * rewrites the keys of a FORMAT_LEGACY store, the values stay where they are. legacy
+         * keys start with three zero bytes and sort before every compact key so each step
+         * takes them from the start, an interrupted migration continues where it stopped
+         * @return the number of keys rewritten or -1 on failure
+         */
+        template<typename _Progress>
+        int64_t migrate_keys(int64_t keys, _Progress &&progress) {
+            std::vector<std::pair<std::string, std::string>> batch;
+            std::string legacy_start(3, '\0');
+            for (;;) {
+                batch.clear();
+                for (auto i = db.lower_bound(legacy_start); i->valid() && batch.size() < MIGRATE_BATCH; i->next()) {
+                    const std::string &k = i->key();
+                    uint32_t type;
+                    _Identity context;
+                    size_t rest;
+                    if (k.compare(0, 3, legacy_start) != 0) break;
+                    if (!read_legacy(k, type, context, rest)) {
+                        std::cerr << "invalid key in data store" << std::endl;
+                        return -1;
+                    }
+                    std::string to;
+                    if (type == ExternalNumber) {
+                        _NumberKey number;
+                        decode(number, k.data(), k.size(), rest);
+                        NumberNode(type, context, number).serialize(to);
+                    } else {
+                        Node(type, context, k.substr(rest)).serialize(to);
+                    }
+                    batch.emplace_back(k, to);
+                }
+                if (batch.empty()) break;
+                for (auto &b : batch) {
+                    if (!db.rekey(b.first, b.second)) {
+                        return -1;
+                    }
+                }
+                keys += batch.size();
+                progress(keys);
+            }
+            return keys;
+        }
+
+        /**
+         * moves the values small enough to be inline into the tree leaves, a step takes the
+         * keys after the last one of the step before
+         * @return keys + the number of values moved
+         */
+        template<typename _Progress>
+        int64_t migrate_values(int64_t keys, _Progress &&progress) {
+            std::vector<std::string> batch;
+            std::string last;
+            bool first = true;
+            for (;;) {
+                batch.clear();
+                for (auto i = db.lower_bound(last); i->valid() && batch.size() < MIGRATE_BATCH; i->next()) {
+                    const std::string &k = i->key();
+                    if (!first && k == last) continue;
+                    batch.push_back(k);
+                }
+                if (batch.empty()) break;
+                first = false;
+                last = batch.back();
+                for (auto &k : batch) {
+                    if (db.make_inline(k)) {
+                        ++keys;
+                    }
+                }
+                progress(keys);
+            }
+            return keys;
+        }
+
+    public:
+        /**
+         * brings the store to FORMAT one format at a time, the format reached is recorded
+         * after each so an interrupted migration continues where it stopped
+         * @param progress progress(keys) is called after each step
+         * @return the number of keys and values rewritten or -1 on failure
+         */
+        template<typename _Progress>
+        int64_t migrate(_Progress &&progress) {
+            if (current) return 0;
+            uint64_t from = db.get_boot(FORMAT_BOOT);
+            if (from > FORMAT) {
+                std::cerr << "unknown data store format " << from << std::endl;
+                return -1;
+            }
+            int64_t keys = 0;
+            if (from == FORMAT_LEGACY) {
+                keys = migrate_keys(keys, progress);
+                if (keys < 0) return -1;
+                db.set_boot(FORMAT_BOOT, FORMAT_COMPACT_KEYS);
+                if (!db.sync()) {
+                    return -1;
+                }
+            }
+            keys = migrate_values(keys, progress);
+            db.set_boot(FORMAT_BOOT, FORMAT);
+            if (!db.sync()) {
+                return -1;
+            }
+            current = true;
+            return keys;
+        }
+
+        /// waits for the group commit that makes all changes so far durable
+        bool sync() const {
+            return db.sync();
+        }
+
+        void set_commit_policy(std::chrono::milliseconds window, uint64_t ops) {
+            db.set_commit_policy(window, ops);
+        }
+
+        void set_compaction_rate(uint64_t bytes_per_second) {
+            db.set_compaction_rate(bytes_per_second);
+        }
+
+        void set_cache_size(uint64_t bytes) {
+            db.set_cache_size(bytes);
+        }
+
+        void set_cache_policy(nst::cache_policy policy) {
+            db.set_cache_policy(policy);
         }
 
         /**
@@ -514,26 +1194,34 @@ namespace replifs {
          * Unless -
          *   the identity space is exhausted
          *   underlying data has been deleted
-         * Note: this is a locking function
-         * @return a unique monotonously increasing value
+         * each thread leases ID_LEASE identities at a time, the id node only stores the
+         * highest identity leased so far. it is written before any identity of the lease is
+         * used so the identities leased but not used before a crash are skipped, never reused
+         * Note: this function only locks when a lease runs out
+         * @return a unique value, increasing per thread
          */
         _Identity create() {
 
             if (!db.is_open()) return _Identity();
-            std::unique_lock<std::mutex> _lock(lock);
-            id_node_data.clear();
-            id_node.serialize(id_node_data);
-            std::string &temp_value = get_per_thread().temp_value;
-            db.get(id_node_data, temp_value);
-            // its ok if its not ok if(s.ok()){}
-            id_value.read(temp_value);
-            ++id_value.value;
-            id_value.serialize(id_value_data);
-            id_node.serialize(id_node_data);
-            if (!db.put(id_node_data, id_value_data)) {
-                return _Identity();
+            auto &t = get_per_thread();
+            if (t.lease_instance != instance || t.lease_next == t.lease_end) {
+                std::unique_lock<std::mutex> _lock(lock);
+                id_node_data.clear();
+                id_node.serialize(id_node_data);
+                db.get(id_node_data, t.temp_value);
+                // its ok if its not ok if(s.ok()){}
+                id_value.read(t.temp_value);
+                _Identity first = id_value.value + 1;
+                id_value.value += ID_LEASE;
+                id_value.serialize(id_value_data);
+                if (!db.put(id_node_data, id_value_data)) {
+                    return _Identity();
+                }
+                t.lease_instance = instance;
+                t.lease_next = first;
+                t.lease_end = first + ID_LEASE;
             }
-            return id_value.value;
+            return t.lease_next++;
         }
 
         bool by_string(StringData &result, _Identity context, const _Key &name) {
@@ -618,6 +1306,52 @@ namespace replifs {
 
         }
 
+        /**
+         * return the raw value buffer of a given context, number pair without copying it
+         * @param context number on the graph
+         * @param number of the node under this context
+         * @param hint access_sequential when the caller reads the nodes in order
+         * @return the pinned buffer or nullptr if the context, number pair is not available
+         */
+        std::shared_ptr<nst::buffer_type> by_number_pinned(_Identity context, uint64_t number,
+                                                           nst::access_hint hint = nst::access_normal) {
+
+            if (!db.is_open()) return nullptr;
+            auto &t = get_per_thread();
+            auto &temp_number = t.temp_number;
+            auto &temp_node_data = t.temp_node_data;
+            temp_number.number = number;
+            temp_number.context = context;
+
+            return db.get_pinned(temp_number.serialize(temp_node_data), hint);
+
+        }
+
+        /**
+         * by_number_pinned for several context, number pairs in one pass
+         * @param keys context, number pairs - in ascending order each lookup starts from the
+         * leaf of the one before
+         * @param values receives the pinned buffer or nullptr for each pair
+         */
+        bool by_number_pinned(const std::vector<std::pair<_Identity, uint64_t>> &keys,
+                              std::vector<std::shared_ptr<nst::buffer_type>> &values,
+                              nst::access_hint hint = nst::access_normal) {
+
+            if (!db.is_open()) return false;
+            auto &t = get_per_thread();
+            auto &temp_number = t.temp_number;
+            auto &temp_keys = t.temp_keys;
+            temp_keys.resize(keys.size());
+            for (size_t i = 0; i < keys.size(); ++i) {
+                temp_number.context = keys[i].first;
+                temp_number.number = keys[i].second;
+                temp_number.serialize(temp_keys[i]);
+            }
+            db.get_pinned(temp_keys, values, hint);
+            return true;
+
+        }
+
         /**
          *
          * @param context
@@ -674,6 +1408,55 @@ namespace replifs {
 
         }
 
+        template<typename _FillFunction>
+        bool fill_raw(_Identity context, _Identity id, uint64_t number, size_t size, size_t intro_offset,
+                      _FillFunction &&fill) {
+
+            if (!db.is_open()) return false;
+            auto &t = get_per_thread();
+            auto &temp_number = t.temp_number;
+            auto &temp_data = t.temp_data;
+            auto &temp_node_data = t.temp_node_data;
+            temp_number.number = number;
+            temp_number.context = context;
+            temp_data.id = id;
+
+            return db.put_with(temp_number.serialize(temp_node_data), size, intro_offset,
+                               std::forward<_FillFunction>(fill));
+
+        }
+
+        /// a write of size bytes at offset into the value of context, number
+        struct NumberMutation {
+            _Identity context;
+            uint64_t number;
+            size_t size;
+            size_t offset;
+        };
+
+        /**
+         * fill_raw for several values in one pass, fill(i, into, size) produces the bytes of
+         * mutations[i]. in ascending order each write starts from the leaf of the one before
+         */
+        template<typename _FillFunction>
+        bool fill_raw(const std::vector<NumberMutation> &mutations, _FillFunction &&fill) {
+
+            if (!db.is_open()) return false;
+            auto &t = get_per_thread();
+            auto &temp_number = t.temp_number;
+            auto &temp_mutations = t.temp_mutations;
+            temp_mutations.resize(mutations.size());
+            for (size_t i = 0; i < mutations.size(); ++i) {
+                temp_number.context = mutations[i].context;
+                temp_number.number = mutations[i].number;
+                temp_number.serialize(temp_mutations[i].key);
+                temp_mutations[i].size = mutations[i].size;
+                temp_mutations[i].offset = mutations[i].offset;
+            }
+            return db.put_with(temp_mutations, std::forward<_FillFunction>(fill));
+
+        }
+
         bool remove(_Identity context, const _Key &name) {
 
             if (!db.is_open()) return false;
@@ -796,13 +1579,29 @@ namespace replifs {
                 node.name = name;
                 node.context = context;
                 lb = node.serialize(lb_data);
-                prefix = lb;
-                prefix.resize(prefix.size() - name.size());
+                prefix.clear();
+                node.append_prefix(prefix);
                 i = db->lower_bound(prefix);
 
                 return valid();
             }
 
+            /// positions at name in context or, if its not there or inclusive is false,
+            /// at the name that follows it
+            bool seek(const _DbType *db, _Identity context, const _Key &name, bool inclusive) {
+                close();
+                node.name = name;
+                node.context = context;
+                lb = node.serialize(lb_data);
+                prefix.clear();
+                node.append_prefix(prefix);
+                i = db->lower_bound(lb);
+                if (!inclusive && i->valid() && i->key() == lb) {
+                    i->next();
+                }
+                return valid();
+            }
+
             prefix_string_iterator() {}
 
             prefix_string_iterator(const _DbType *db, _Identity context, const _Key name) {
@@ -863,8 +1662,8 @@ namespace replifs {
                 number.number = n;
                 number.context = context;
                 lb = number.serialize(lb_data);
-                prefix = lb;
-                prefix.resize(prefix.size() - sizeof(_NumberKey));
+                prefix.clear();
+                number.append_prefix(prefix);
                 i = db->lower_bound(prefix);
 
                 return valid();
@@ -923,11 +1722,11 @@ namespace replifs {
             for (; iter.valid(); iter.next()) {
                 auto kv = iter.i->key();
                 auto iv = iter.i->value();
-                uint32_t type;
-                if (decode(type, kv.data(), kv.size(), 0) != sizeof(type)) {
+                if (kv.empty()) {
                     // invalid key - stop iterating?
                     return false;
                 }
+                uint32_t type = (uint8_t) kv[0];
                 if (type == External) {
                     t.temp_data.read(iv);
                     t.temp_node.read(kv);
@@ -956,11 +1755,11 @@ namespace replifs {
             for (; iter.valid(); iter.next()) {
                 auto kv = iter.i->key();
                 auto iv = iter.i->value();
-                uint32_t type;
-                if (decode(type, kv.data(), kv.size(), 0) != sizeof(type)) {
+                if (kv.empty()) {
                     // invalid key - stop iterating?
                     return false;
                 }
+                uint32_t type = (uint8_t) kv[0];
                 if (type == ExternalNumber) {
                     t.temp_data.read(iv);
                     t.temp_number.read(kv);
@@ -981,6 +1780,10 @@ namespace replifs {
             return p.move(&db, context, name);
         }
 
+        bool seek(prefix_string_iterator &p, _Identity context, const _Key &name, bool inclusive) const {
+            return p.seek(&db, context, name, inclusive);
+        }
+
         bool move(prefix_number_iterator &p, _Identity context, const _NumberKey number) const {
             return p.move(&db, context, number);
         }
@@ -0,0 +1,202 @@
+//
+// fixed capacity cache with CLOCK eviction and no allocation after construction
+//
+
+#ifndef REPLIFS_CLOCK_CACHE_H
+#define REPLIFS_CLOCK_CACHE_H
+
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+/**
+ * the values live in preallocated slots found through an open addressing index (linear
+ * probing, backward shift deletion). a hit only sets the slots reference bit, when the
+ * cache is full the clock hand passes over referenced slots (clearing the bit) and evicts
+ * the first one that was not used since its last pass
+ */
+template<typename _K, typename _V, typename _Hash = std::hash<_K>>
+class clock_cache {
+private:
+    struct slot {
+        _K key{};
+        _V value{};
+        bool used{false};
+        bool referenced{false};
+    };
+    static constexpr uint32_t EMPTY = ~(uint32_t) 0;
+
+    std::vector<slot> slots;
+    std::vector<uint32_t> index; // slot numbers, EMPTY where unused
+    std::vector<uint32_t> unused; // free slot numbers
+    size_t mask{0};
+    size_t used{0};
+    size_t hand{0};
+    _Hash hasher;
+
+    size_t home(const _K &k) const {
+        // spread sequential keys (logical addresses) over the index
+        return (size_t) (((uint64_t) hasher(k) * 0x9E3779B97F4A7C15ull) >> 17) & mask;
+    }
+
+    size_t position(const _K &k) const {
+        for (size_t i = home(k);; i = (i + 1) & mask) {
+            uint32_t s = index[i];
+            if (s == EMPTY || slots[s].key == k) return i;
+        }
+    }
+
+    void unindex(size_t i) {
+        size_t j = i;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (index[j] == EMPTY) break;
+            size_t h = home(slots[index[j]].key);
+            // entries whose home lies cyclically in (i, j] stay where they are
+            if ((i <= j) ? (i < h && h <= j) : (i < h || h <= j)) continue;
+            index[i] = index[j];
+            i = j;
+        }
+        index[i] = EMPTY;
+    }
+
+    void release(uint32_t s) {
+        slots[s].used = false;
+        slots[s].referenced = false;
+        slots[s].value = _V();
+        unused.push_back(s);
+        --used;
+    }
+
+    template<typename _CallBack>
+    void evict(_CallBack &&cb) {
+        for (;;) {
+            slot &v = slots[hand];
+            size_t victim = hand;
+            hand = (hand + 1) % slots.size();
+            if (!v.used) continue;
+            if (v.referenced) {
+                v.referenced = false;
+                continue;
+            }
+            cb(v.key, v.value);
+            unindex(position(v.key));
+            release((uint32_t) victim);
+            return;
+        }
+    }
+
+public:
+    clock_cache() : clock_cache(10) {}
+
+    clock_cache(size_t limit) {
+        if (limit == 0) limit = 1;
+        slots.resize(limit);
+        size_t size = 1;
+        while (size < limit * 2) size <<= 1;
+        index.assign(size, EMPTY);
+        mask = size - 1;
+        unused.reserve(limit);
+        for (size_t s = limit; s > 0; --s) {
+            unused.push_back((uint32_t) (s - 1));
+        }
+    }
+
+    void insert(const _K &k, const _V &v) {
+        insert(k, v, [&](const _K &, const _V &) {});
+    }
+
+    /**
+     * adds or replaces a value, when the cache is full cb(key, value) is called for the
+     * evicted entry before it is dropped - never for k itself
+     */
+    template<typename _CallBack>
+    void insert(const _K &k, const _V &v, _CallBack &&cb) {
+        size_t i = position(k);
+        if (index[i] != EMPTY) {
+            slots[index[i]].value = v;
+            slots[index[i]].referenced = true;
+            return;
+        }
+        if (unused.empty()) {
+            evict(cb);
+            i = position(k); // eviction may have shifted the index
+        }
+        uint32_t s = unused.back();
+        unused.pop_back();
+        slots[s].key = k;
+        slots[s].value = v;
+        slots[s].used = true;
+        slots[s].referenced = false;
+        index[i] = s;
+        ++used;
+    }
+
+    bool remove(const _K &k) {
+        return erase(k);
+    }
+
+    bool erase(const _K &k) {
+        size_t i = position(k);
+        if (index[i] == EMPTY) return false;
+        uint32_t s = index[i];
+        unindex(i);
+        release(s);
+        return true;
+    }
+
+    /// the cached value or nullptr, valid until the next insert or erase
+    _V *find(const _K &k) {
+        uint32_t s = index[position(k)];
+        if (s == EMPTY) return nullptr;
+        slots[s].referenced = true;
+        return &slots[s].value;
+    }
+
+    /// look at a cached value without marking it as used
+    const _V *peek(const _K &k) const {
+        uint32_t s = index[position(k)];
+        if (s == EMPTY) return nullptr;
+        return &slots[s].value;
+    }
+
+    size_t count(const _K &k) const {
+        return index[position(k)] != EMPTY ? 1 : 0;
+    }
+
+    size_t size() const {
+        return used;
+    }
+
+    bool empty() const {
+        return used == 0;
+    }
+
+    void clear() {
+        if (used == 0) return;
+        for (size_t i = 0; i < index.size(); ++i) {
+            if (index[i] != EMPTY) {
+                release(index[i]);
+                index[i] = EMPTY;
+            }
+        }
+        hand = 0;
+    }
+
+    /// calls cb(key, value) for every entry
+    template<typename _CallBack>
+    void for_each(_CallBack &&cb) {
+        for (auto &s : slots) {
+            if (s.used) cb(s.key, s.value);
+        }
+    }
+
+    /// calls cb(key, value) for every entry and empties the cache
+    template<typename _CallBack>
+    void flush(_CallBack &&cb) {
+        for_each(cb);
+        clear();
+    }
+};
+
+#endif //REPLIFS_CLOCK_CACHE_H
@@ -0,0 +1,98 @@
+//
+// moves data away from the end of a file_storage_alloc so the file can shrink
+//
+
+#ifndef REPLIFS_COMPACTOR_H
+#define REPLIFS_COMPACTOR_H
+
+#include <chrono>
+#include "transaction.h"
+
+namespace persist {
+    namespace storage {
+        /**
+         * relocates the allocations at the end of the file into free space before them
+         * through an ordinary transaction commit, then truncates the free space left at the
+         * end. each step moves only as many bytes as the rate allows since the previous one
+         */
+        class compactor {
+        private:
+            typedef std::chrono::steady_clock _Clock;
+            file_storage_alloc *fa{nullptr};
+            // bytes moved per second, 0 disables compaction
+            u64 rate{0};
+            // the most bytes moved in one step however long the previous one was ago
+            u64 burst{1024 * 1024};
+            // free space below which a file is not worth compacting
+            u64 min_free{1024 * 1024};
+            _Clock::time_point last{_Clock::now()};
+            u64 moved{0};
+            u64 released{0};
+
+        public:
+            compactor(file_storage_alloc *fa) : fa(fa) {}
+
+            void set_rate(u64 bytes_per_second) {
+                rate = bytes_per_second;
+            }
+
+            u64 get_rate() const {
+                return rate;
+            }
+
+            /// bytes relocated so far
+            u64 get_moved() const {
+                return moved;
+            }
+
+            /// bytes truncated from the file so far
+            u64 get_released() const {
+                return released;
+            }
+
+            /**
+             * one increment of compaction
+             * @param tx a transaction without changes, it is committed and begun again when
+             * anything is relocated
+             * @return bytes truncated from the file
+             */
+            u64 step(transaction &tx) {
+                if (fa == nullptr || rate == 0) return 0;
+                auto now = _Clock::now();
+                double seconds = std::chrono::duration<double>(now - last).count();
+                u64 allowance = std::min<u64>(burst, (u64) (seconds * rate));
+                if (allowance < 4096) return 0;
+                last = now;
+                if (fa->get_free_space().bytes() < min_free || !fa->exclusive()) {
+                    return 0;
+                }
+                u64 relocated = 0;
+                for (auto &a : fa->tail_allocations(allowance)) {
+                    if (tx.get_alloc(a.first) != a.second) continue; // changed in this transaction
+                    auto target = fa->allocate_below(a.second.size, a.second.position);
+                    if (target.empty()) break; // the tail before it is no lower
+                    if (!fa->copy_data(a.second, target.position)) {
+                        fa->release(target);
+                        break;
+                    }
+                    tx.write_allocation_record(target, a.first);
+                    relocated += target.size;
+                }
+                if (relocated > 0) {
+                    if (!tx.commit()) {
+                        print_err("could not commit relocated data in", fa->get_name());
+                        tx.begin();
+                        return 0;
+                    }
+                    if (!tx.begin()) return 0;
+                    moved += relocated;
+                    print_dbg("relocated", relocated, "bytes in", fa->get_name());
+                }
+                u64 r = fa->truncate_free_tail();
+                released += r;
+                return r;
+            }
+        };
+    }
+}
+#endif //REPLIFS_COMPACTOR_H
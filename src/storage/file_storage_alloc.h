@@ -6,8 +6,14 @@
 #define REPLIFS_FILE_STORAGE_ALLOC_H
 
 #include "structured_file.h"
-#include "lru_cache.h"
+#include "free_extents.h"
+#include "page_cache.h"
+#include <list>
 #include <set>
+#include <unordered_set>
+#include <map>
+#include <vector>
+#include <algorithm>
 
 namespace persist {
     namespace storage {
@@ -17,24 +23,47 @@ namespace persist {
             const u64 MAX_BOOT_KEY = 64;
             const u64 EXTERNAL_BOOT_VAL_START = 32;
 
-            const u64 MAX_LOGICAL_ADDRESS = 10000000;
-            const u64 FALLOC_VERSION = 0x80000002L;
+            // the allocation table is split into segments allocated like data when first
+            // written to, the header only holds a directory of segment positions
+            const u64 SEGMENT_RECORDS = 65536;
+            const u64 SEGMENT_SIZE = SEGMENT_RECORDS * sizeof(AllocationRecord);
+            const u64 MAX_SEGMENTS = 65536;
+            const u64 MAX_LOGICAL_ADDRESS = MAX_SEGMENTS * SEGMENT_RECORDS;
+            // segments start at multiples of this so they can be mapped
+            const u64 TABLE_ALIGN = 65536;
+            // files with a single 10M record allocation table after the boot table
+            const u64 LEGACY_FALLOC_VERSION = 0x80000002L;
+            const u64 FALLOC_VERSION = 0x80000003L;
             const u64 VERSION_SIZE = 4 * sizeof(u64);
             const u64 VERSION_START = 0ull;
             // computed header position list
             const u64 BOOT_TABLE_START = VERSION_START + VERSION_SIZE;
             const u64 BOOT_TABLE_SIZE = MAX_BOOT_KEY * sizeof(u64);
-            const u64 ALLOC_TABLE_START = BOOT_TABLE_START + BOOT_TABLE_SIZE;
-            const u64 ALLOC_TABLE_SIZE = MAX_LOGICAL_ADDRESS * sizeof(AllocationRecord);
+            const u64 DIRECTORY_START = BOOT_TABLE_START + BOOT_TABLE_SIZE;
+            const u64 DIRECTORY_SIZE = MAX_SEGMENTS * sizeof(u64);
 
             const u64 HEADER_START = VERSION_START;
-            const u64 HEADER_SIZE = ALLOC_TABLE_START + ALLOC_TABLE_SIZE;
+            const u64 HEADER_SIZE = (DIRECTORY_START + DIRECTORY_SIZE + TABLE_ALIGN - 1) / TABLE_ALIGN * TABLE_ALIGN;
             /// boot and allocation table layout end
 
+            // the table of LEGACY_FALLOC_VERSION files, converted to segments when opened
+            const u64 LEGACY_TABLE_START = BOOT_TABLE_START + BOOT_TABLE_SIZE;
+            const u64 LEGACY_MAX_LOGICAL_ADDRESS = 10000000;
+            const u64 LEGACY_HEADER_SIZE = LEGACY_TABLE_START + LEGACY_MAX_LOGICAL_ADDRESS * sizeof(AllocationRecord);
+
             // there can be a maximum of 16 concurrent versions active
             // more versions will
             const u64 MAX_VERSION = 16;
 
+            /// write ahead log records: magic, txid, alloc count, boot count, the
+            /// (logical, AllocationRecord) and (key, value) pairs and a checksum
+            const u64 WAL_MAGIC = 0x57414C5245434F52ull;
+            const u64 WAL_HEADER_SIZE = 4 * sizeof(u64);
+            const u64 WAL_ALLOC_SIZE = sizeof(u64) + sizeof(AllocationRecord);
+            const u64 WAL_BOOT_SIZE = 2 * sizeof(u64);
+            // the log is applied to the tables in place and truncated once its this large
+            const u64 WAL_CHECKPOINT_SIZE = 16ull * 1024ull * 1024ull;
+
         };
 
 
@@ -90,7 +119,35 @@ namespace persist {
 
             mutable u64 error_count{0};
             // the free pages that can be reused for other transactions and data
-            std::set<AllocationRecord> free_map;
+            // derived from the allocation table when the file is opened
+            free_extents free_space;
+            // logical address of every record in the table by position, to find the
+            // allocations at the end of the file
+            std::map<u64, u64> live;
+            // records replaced by the commit in progress, retired once it is logged
+            std::vector<std::pair<u64, AllocationRecord>> replaced;
+            // records replaced by logged commits that transactions on older versions may still
+            // resolve to, with the version holding their replacements
+            struct retired_record {
+                types::version_id holder;
+                u64 logical;
+                AllocationRecord record;
+            };
+            std::vector<retired_record> retired;
+        public:
+            /// a commit applied in memory whose log record is not yet written, see prepare
+            struct prepared_commit {
+                buffer_type record;
+                u64 at{0}; // where the record goes in the log
+                std::vector<std::pair<u64, AllocationRecord>> alloc;
+                std::vector<std::pair<u64, u64>> boot;
+                std::vector<std::pair<u64, AllocationRecord>> replaced;
+                types::version_id holder{0}; // the version the commit was applied to
+                bool logged{false};
+            };
+        private:
+            // decoded pages shared by the transactions on this file
+            page_cache pages;
             _VersionMap version_map;
             _VersionList version_list;
 
@@ -103,6 +160,50 @@ namespace persist {
             
             bool doverifyallocations{false};
 
+            // commits append their table changes here instead of writing them in place
+            structured_file wal;
+            u64 wal_size{0};
+            // changes of the commit in progress, logged only if it succeeds
+            std::vector<std::pair<u64, AllocationRecord>> log_alloc;
+            std::vector<std::pair<u64, u64>> log_boot;
+            // boot values changed outside a commit (new_logical), logged with the next one
+            std::unordered_map<u64, u64> pending_boot;
+            bool logical_changed{false};
+            // a mapped range of the file and the part of it stored to since the last checkpoint
+            struct mapped_table {
+                u8 *data{nullptr};
+                u64 dirty_from{0};
+                u64 dirty_to{0};
+
+                bool dirty() const {
+                    return dirty_from != dirty_to;
+                }
+
+                template<typename _vT>
+                _vT load(u64 at) const {
+                    _vT r = _vT();
+                    primitive::decode(r, (const u8 *) data + at, (const u8 *) data + at + sizeof(_vT));
+                    return r;
+                }
+
+                template<typename _vT>
+                void store(u64 at, const _vT &value) {
+                    primitive::encode(data + at, data + at + sizeof(_vT), value);
+                    if (!dirty()) {
+                        dirty_from = at;
+                        dirty_to = at + sizeof(_vT);
+                    } else {
+                        dirty_from = std::min<u64>(dirty_from, at);
+                        dirty_to = std::max<u64>(dirty_to, at + sizeof(_vT));
+                    }
+                }
+            };
+            // the version, boot table and segment directory
+            mapped_table header;
+            // allocation table segments by number, mapped when first used
+            std::vector<mapped_table> segments;
+            std::vector<u64> dirty_segments;
+
             _VersionPtr latest_version() {
                 return version_list.begin();
             }
@@ -136,6 +237,33 @@ namespace persist {
                 return v;
             }
 
+            /**
+             * releases the retired records no open transaction can resolve to any more: a
+             * transaction sees the versions from the one it locked to the oldest, so a record is
+             * in use while a version older than its holder is locked. new transactions lock the
+             * latest version, so once free a record stays free
+             */
+            void release_retired() {
+                if (retired.empty()) return;
+                thread_local std::unordered_set<types::version_id> blocked;
+                blocked.clear();
+                bool older_locked = false;
+                for (auto v = version_list.rbegin(); v != version_list.rend(); ++v) {
+                    if (older_locked) blocked.insert(v->txid);
+                    older_locked = older_locked || v->locks > 0;
+                }
+                size_t kept = 0;
+                for (auto &r : retired) {
+                    if (blocked.count(r.holder)) {
+                        retired[kept++] = r;
+                    } else {
+                        pages.erase(r.logical, r.record.version);
+                        release(r.record);
+                    }
+                }
+                retired.resize(kept);
+            }
+
             bool unlock_version(u64 txid) {
                 print_dbg("source_txid",txid);
                 auto v = version_map.find(txid);
@@ -149,6 +277,129 @@ namespace persist {
                 return false;
             }
 
+            bool map_header() {
+                header = mapped_table();
+                header.data = map_at(constants.HEADER_START, constants.HEADER_SIZE);
+                if (header.data == nullptr) {
+                    ++error_count;
+                    print_err("could not map the allocation table of", name);
+                    return false;
+                }
+                return true;
+            }
+
+            void unmap_tables() {
+                for (auto &t : segments) {
+                    unmap(t.data, constants.SEGMENT_SIZE);
+                }
+                segments.clear();
+                dirty_segments.clear();
+                unmap(header.data, constants.HEADER_SIZE);
+                header = mapped_table();
+            }
+
+            bool flush_table(mapped_table &t) {
+                if (!t.dirty()) return true;
+                if (!flush_mapped(t.data, t.dirty_from, t.dirty_to)) {
+                    ++error_count;
+                    return false;
+                }
+                t.dirty_from = t.dirty_to = 0;
+                return true;
+            }
+
+            /**
+             * appends an empty segment to the file, it is a hole until records are stored
+             * the new size is synched so the directory never refers past the end of the file
+             * @return the position of the segment or 0 on error
+             */
+            u64 allocate_segment() {
+                u64 at = (file_size + constants.TABLE_ALIGN - 1) / constants.TABLE_ALIGN * constants.TABLE_ALIGN;
+                if (!resize(at + constants.SEGMENT_SIZE) || !synch()) {
+                    ++error_count;
+                    print_err("could not extend the allocation table of", name);
+                    return 0;
+                }
+                free_space.insert(file_size, at - file_size);
+                file_size = at + constants.SEGMENT_SIZE;
+                print_dbg("allocated table segment at", at);
+                return at;
+            }
+
+            /**
+             * the mapped segment holding a logical address
+             * @param create allocate the segment if it does not exist yet
+             * @return nullptr if the segment does not exist or on error
+             */
+            mapped_table *segment(u64 number, bool create) {
+                if (number >= constants.MAX_SEGMENTS || header.data == nullptr) return nullptr;
+                if (segments.size() <= number) {
+                    segments.resize(number + 1);
+                }
+                if (segments[number].data != nullptr) {
+                    return &segments[number];
+                }
+                const u64 entry = constants.DIRECTORY_START + number * sizeof(u64);
+                u64 at = header.load<u64>(entry);
+                if (at == 0) {
+                    if (!create) return nullptr;
+                    at = allocate_segment();
+                    if (at == 0) return nullptr;
+                    header.store(entry, at);
+                }
+                u8 *data = map_at(at, constants.SEGMENT_SIZE);
+                if (data == nullptr) {
+                    ++error_count;
+                    print_err("could not map allocation table segment", number, "of", name);
+                    return nullptr;
+                }
+                segments[number].data = data;
+                return &segments[number];
+            }
+
+            // table stores - only once the change is in the log, the mapping may be written
+            // back at any time
+            bool write_int_boot_value(u64 k, u64 val) {
+                if (error_count) return false;
+                print_dbg("k",k,"val",val);
+                header.store<u64>(constants.BOOT_TABLE_START + k * sizeof(u64), val + 1);
+                return true;
+            }
+
+            bool write_allocation_record(AllocationRecord current, u64 l) {
+                if (error_count) return false;
+                if (l >= constants.MAX_LOGICAL_ADDRESS) {
+                    print_err("logical address", l, "is outside the allocation table");
+                    ++error_count;
+                    return false;
+                }
+                print_dbg("write allocation record in file {", current.size, current.position, current.version, "} at", l);
+                const u64 number = l / constants.SEGMENT_RECORDS;
+                mapped_table *t = segment(number, true);
+                if (t == nullptr) return false;
+                if (!t->dirty()) {
+                    dirty_segments.push_back(number);
+                }
+                const u64 at = sizeof(AllocationRecord) * (l % constants.SEGMENT_RECORDS);
+                auto previous = t->load<AllocationRecord>(at);
+                if (!previous.empty()) {
+                    auto p = live.find(previous.position);
+                    if (p != live.end() && p->second == l) {
+                        live.erase(p);
+                    }
+                }
+                t->store(at, current);
+                if (!current.empty()) {
+                    live[current.position] = l;
+                }
+                if (doverifyallocations && t->load<AllocationRecord>(at) != current) {
+                    print_err("alloc verify failed");
+                    return false;
+                }
+                return true;
+            }
+
+            // logged table changes - durable once the commit that logs them has returned
             bool commit_int_boot_value(u64 k, u64 val) {
                 if (error_count) return false;
                 if (k >= constants.MAX_BOOT_KEY) {
@@ -157,48 +408,350 @@ namespace persist {
                     return false;
                 }
                 print_dbg("k",k,"val",val);
-                seek(constants.BOOT_TABLE_START + k * sizeof(u64), "int boot table");
-                u64 vval = val + 1;
-                return set(vval);
+                log_boot.emplace_back(k, val);
+                return true;
             }
 
             bool commit_allocation_record(AllocationRecord current, u64 l) {
                 if (error_count) return false;
-                print_dbg("commit allocation record in file {", current.size, current.position, current.version, "} at", l);
-                seek(constants.ALLOC_TABLE_START + sizeof(AllocationRecord) * l, "write alloc rec.");
-                if (set(current)) {
-                    if (doverifyallocations) {
-                        AllocationRecord test = get_alloc(l);
-                        if (test != current) {
-                            print_err("alloc verify failed");
-                            return false;
+                print_dbg("commit allocation record in log {", current.size, current.position, current.version, "} at", l);
+                log_alloc.emplace_back(l, current);
+                return true;
+            }
+
+            static u64 wal_checksum(const buffer_type &record, size_t size) {
+                u64 h = 14695981039346656037ull;
+                for (size_t i = 0; i < size; ++i) {
+                    h ^= record[i];
+                    h *= 1099511628211ull;
+                }
+                return h;
+            }
+
+            /**
+             * encodes the changes of the commit in progress as one log record and reserves its
+             * place in the log, they are moved into c
+             */
+            void encode_log(types::version_id txid, prepared_commit &c) {
+                if (logical_changed) {
+                    log_boot.emplace_back(Logical_Index, get_int_boot_value(Logical_Index).second);
+                    logical_changed = false;
+                }
+                c.record.clear();
+                c.alloc.swap(log_alloc);
+                c.boot.swap(log_boot);
+                c.replaced.swap(replaced);
+                c.logged = false;
+                if (c.alloc.empty() && c.boot.empty()) {
+                    return;
+                }
+                c.record.resize(constants.WAL_HEADER_SIZE + c.alloc.size() * constants.WAL_ALLOC_SIZE +
+                                c.boot.size() * constants.WAL_BOOT_SIZE + sizeof(u64));
+                auto w = c.record.begin();
+                auto e = c.record.end();
+                w += primitive::encode(w, e, constants.WAL_MAGIC);
+                w += primitive::encode(w, e, (u64) txid);
+                w += primitive::encode(w, e, (u64) c.alloc.size());
+                w += primitive::encode(w, e, (u64) c.boot.size());
+                for (auto &a : c.alloc) {
+                    w += primitive::encode(w, e, a.first);
+                    w += primitive::encode(w, e, a.second);
+                }
+                for (auto &b : c.boot) {
+                    w += primitive::encode(w, e, b.first);
+                    w += primitive::encode(w, e, b.second);
+                }
+                w += primitive::encode(w, e, wal_checksum(c.record, w - c.record.begin()));
+                c.at = wal_size;
+                wal_size += c.record.size();
+            }
+
+        public:
+            /**
+             * makes a prepared commit durable: the data it refers to is synched first, then its
+             * record is appended to the log and the log synched. it only touches the files so it
+             * can run while other threads use the storage, one prepared commit at a time
+             */
+            bool log(prepared_commit &c) {
+                c.logged = c.record.empty() || (synch() && wal.write_at(c.record, c.at) && wal.synch());
+                return c.logged;
+            }
+
+            /**
+             * finishes a prepared commit once log returned: the logged changes are stored in the
+             * tables and the records they replaced are retired, see release_retired
+             * @return false if the commit could not be logged, the storage fails from then on
+             */
+            bool complete(prepared_commit &c) {
+                bool r = c.logged;
+                if (!r) {
+                    ++error_count;
+                    print_err("could not append to the write ahead log", wal.get_name());
+                }
+                for (auto &a : c.alloc) {
+                    if (r && !write_allocation_record(a.second, a.first)) r = false;
+                }
+                for (auto &b : c.boot) {
+                    if (r && !write_int_boot_value(b.first, b.second)) r = false;
+                    // a newer value set since the commit was prepared is logged with the next one
+                    auto u = pending_boot.find(b.first);
+                    if (r && u != pending_boot.end() && u->second == b.second) {
+                        pending_boot.erase(u);
+                    }
+                }
+                if (r) {
+                    for (auto &p : c.replaced) {
+                        retired.push_back({c.holder, p.first, p.second});
+                    }
+                    release_retired();
+                    if (wal_size >= constants.WAL_CHECKPOINT_SIZE) {
+                        checkpoint();
+                    }
+                }
+                c.alloc.clear();
+                c.boot.clear();
+                c.replaced.clear();
+                c.record.clear();
+                return r;
+            }
+
+        private:
+            /**
+             * makes the table stores since the last checkpoint durable and truncates the log
+             * a crash in between replays the same changes again at the next open
+             */
+            bool checkpoint() {
+                if (error_count) return false;
+                // segments before the directory that refers to them
+                for (u64 number : dirty_segments) {
+                    if (!flush_table(segments[number])) return false;
+                }
+                dirty_segments.clear();
+                if (!flush_table(header)) return false;
+                if (wal_size > 0) {
+                    if (!wal.resize(0) || !wal.synch()) {
+                        ++error_count;
+                        return false;
+                    }
+                    wal_size = 0;
+                }
+                return true;
+            }
+
+            /**
+             * applies the log left by the last run to the tables, a torn or corrupt record
+             * ends the log since its commit never returned
+             */
+            bool replay_log() {
+                u64 size = wal.file_size();
+                if (wal.get_error_count()) return false;
+                if (size == 0) return true;
+                buffer_type log(size);
+                if (!wal.read_at(&log[0], size, 0)) {
+                    return false;
+                }
+                size_t at = 0;
+                u64 records = 0;
+                while (at + constants.WAL_HEADER_SIZE <= size) {
+                    auto r = log.begin() + at;
+                    auto e = log.end();
+                    u64 magic = 0, txid = 0, allocs = 0, boots = 0;
+                    r += primitive::decode(magic, r, e);
+                    r += primitive::decode(txid, r, e);
+                    r += primitive::decode(allocs, r, e);
+                    r += primitive::decode(boots, r, e);
+                    if (magic != constants.WAL_MAGIC) break;
+                    u64 body = allocs * constants.WAL_ALLOC_SIZE + boots * constants.WAL_BOOT_SIZE;
+                    if (body > size || at + constants.WAL_HEADER_SIZE + body + sizeof(u64) > size) break;
+                    u64 check = 0;
+                    primitive::decode(check, r + body, e);
+                    buffer_type record(log.begin() + at, r + body);
+                    if (check != wal_checksum(record, record.size())) break;
+                    for (u64 i = 0; i < allocs; ++i) {
+                        u64 l = 0;
+                        AllocationRecord ar;
+                        r += primitive::decode(l, r, e);
+                        r += primitive::decode(ar, r, e);
+                        if (!write_allocation_record(ar, l)) return false;
+                    }
+                    for (u64 i = 0; i < boots; ++i) {
+                        u64 k = 0, v = 0;
+                        r += primitive::decode(k, r, e);
+                        r += primitive::decode(v, r, e);
+                        if (!write_int_boot_value(k, v)) return false;
+                    }
+                    at += constants.WAL_HEADER_SIZE + body + sizeof(u64);
+                    ++records;
+                }
+                if (at != size) {
+                    print_wrn("ignoring", size - at, "bytes at the end of", wal.get_name());
+                }
+                print_dbg("replayed", records, "records from", wal.get_name());
+                wal_size = size;
+                return true;
+            }
+
+            bool open_log() {
+                std::string log_name = name + ".wal";
+                if (!wal.exists(log_name) && !wal.create_file(log_name)) {
+                    print_err("could not create", log_name);
+                    return false;
+                }
+                return wal.open_file(log_name);
+            }
+
+            /**
+             * everything between the header and the end of the file that is neither a
+             * table segment nor referred to by the allocation table is free
+             * anything released but not yet committed before the last close was lost, so
+             * this runs at every open instead of persisting the extents
+             */
+            bool rebuild_free_space() {
+                free_space.clear();
+                live.clear();
+                std::vector<std::pair<u64, u64>> used; // position, size
+                for (u64 number = 0; number < constants.MAX_SEGMENTS; ++number) {
+                    mapped_table *t = segment(number, false);
+                    if (error_count) return false;
+                    if (t == nullptr) continue;
+                    used.emplace_back(header.load<u64>(constants.DIRECTORY_START + number * sizeof(u64)), constants.SEGMENT_SIZE);
+                    for (u64 r = 0; r < constants.SEGMENT_RECORDS; ++r) {
+                        auto ar = t->load<AllocationRecord>(r * sizeof(AllocationRecord));
+                        if (!ar.empty()) {
+                            live[ar.position] = number * constants.SEGMENT_RECORDS + r;
+                        }
+                        if (!ar.empty() && ar.size > 0) {
+                            used.emplace_back(ar.position, ar.size);
                         }
                     }
-                    return true;
-                };
-                return false;
+                }
+                std::sort(used.begin(), used.end());
+                u64 end = constants.HEADER_START + constants.HEADER_SIZE;
+                for (auto &u : used) {
+                    if (u.first < constants.HEADER_START + constants.HEADER_SIZE) {
+                        print_wrn("allocation at", u.first, "overlaps the header of", name);
+                    } else if (u.first > end) {
+                        free_space.insert(end, u.first - end);
+                    }
+                    end = std::max(end, u.first + u.second);
+                }
+                if (end > file_size) {
+                    ++error_count;
+                    print_err("allocations extend past the end of", name);
+                    return false;
+                }
+                free_space.insert(end, file_size - end);
+                print_dbg("rebuilt", free_space.count(), "free extents,", free_space.bytes(), "bytes");
+                return true;
             }
 
             bool scan_allocation_map() {
-                if (!seek(constants.ALLOC_TABLE_START, "alloc table")) {
+                for (u64 number = 0; number < constants.MAX_SEGMENTS; ++number) {
+                    u64 at = header.load<u64>(constants.DIRECTORY_START + number * sizeof(u64));
+                    if (at == 0) continue;
+                    if (at < constants.HEADER_START + constants.HEADER_SIZE || at % constants.TABLE_ALIGN != 0 ||
+                        at + constants.SEGMENT_SIZE > file_size) {
+                        ++error_count;
+                        print_err("allocation table segment", number, "at", at, "is outside", name);
+                        return false;
+                    }
+                }
+                return error_count == 0;
+            }
+
+            /**
+             * copies the records of a LEGACY_FALLOC_VERSION table into segments appended to the
+             * file, the old table becomes free space. the directory overwrites the start of the
+             * old table so that part is kept in name.legacy until the new version is written, a
+             * conversion interrupted by a crash starts over from it at the next open
+             */
+            bool convert_legacy() {
+                if (file_size < constants.LEGACY_HEADER_SIZE) {
+                    ++error_count;
+                    print_err("'", name, "' is too small for its allocation table");
                     return false;
                 }
-                auto alloc = get<AllocationRecord>();
-                u64 logical = 1;
-                while (!alloc.empty() && error_count == 0 && logical < constants.MAX_LOGICAL_ADDRESS) {
-                    if (logical == constants.MAX_LOGICAL_ADDRESS) { // do not attempt to read more
-                        wrn_print("File data allocation table is full");
-                        break;
+                const std::string saved_name = name + ".legacy";
+                structured_file saved;
+                buffer_type directory(constants.DIRECTORY_SIZE + sizeof(u64));
+                u64 check = 0;
+                if (saved.exists(saved_name) && saved.open_file(saved_name) &&
+                    saved.file_size() == directory.size() && saved.read_at(&directory[0], directory.size(), 0)) {
+                    primitive::decode(check, directory.begin() + constants.DIRECTORY_SIZE, directory.end());
+                }
+                if (check != 0 && check == wal_checksum(directory, constants.DIRECTORY_SIZE)) {
+                    print_wrn("continuing the interrupted conversion of", name);
+                    if (!write_at(&directory[0], constants.DIRECTORY_SIZE, constants.DIRECTORY_START) || !synch()) {
+                        return false;
+                    }
+                } else {
+                    saved.close();
+                    // a partly written copy means the header was not changed yet
+                    if (!read_at(&directory[0], constants.DIRECTORY_SIZE, constants.DIRECTORY_START)) {
+                        return false;
+                    }
+                    primitive::encode(directory.begin() + constants.DIRECTORY_SIZE, directory.end(),
+                                      wal_checksum(directory, constants.DIRECTORY_SIZE));
+                    if (!saved.create_file(saved_name) || !saved.open_file(saved_name) ||
+                        !saved.write_at(directory, 0) || !saved.synch()) {
+                        saved.close();
+                        ++error_count;
+                        print_err("could not save the allocation table of", name, "to", saved_name);
+                        return false;
+                    }
+                }
+                saved.close();
+
+                u64 records = constants.LEGACY_MAX_LOGICAL_ADDRESS;
+                u64 logical = header.load<u64>(constants.BOOT_TABLE_START + Logical_Index * sizeof(u64));
+                if (logical > 0 && logical < records) {
+                    records = logical; // the boot value is one past the last logical address
+                }
+                buffer_type legacy(constants.SEGMENT_SIZE);
+                for (u64 number = 0; number * constants.SEGMENT_RECORDS < records; ++number) {
+                    const u64 first = number * constants.SEGMENT_RECORDS;
+                    const u64 count = std::min(constants.SEGMENT_RECORDS, records - first);
+                    if (!read_at(&legacy[0], count * sizeof(AllocationRecord),
+                                 constants.LEGACY_TABLE_START + first * sizeof(AllocationRecord))) {
+                        return false;
+                    }
+                    if (number == 0) {
+                        // the first segment is read before the directory replaces it
+                        for (u64 d = 0; d < constants.MAX_SEGMENTS; ++d) {
+                            header.store<u64>(constants.DIRECTORY_START + d * sizeof(u64), 0);
+                        }
+                    }
+                    for (u64 r = 0; r < count; ++r) {
+                        AllocationRecord ar;
+                        auto at = legacy.begin() + r * sizeof(AllocationRecord);
+                        primitive::decode(ar, at, at + sizeof(AllocationRecord));
+                        if (!ar.empty() && !write_allocation_record(ar, first + r)) {
+                            return false;
+                        }
                     }
-                    alloc = get<AllocationRecord>();
                 }
-                return error_count == 0;
+                // segments and directory before the version that makes them valid
+                for (u64 number : dirty_segments) {
+                    if (!flush_table(segments[number])) return false;
+                }
+                dirty_segments.clear();
+                if (!flush_table(header)) return false;
+                header.store(constants.VERSION_START, constants.FALLOC_VERSION);
+                if (!flush_table(header)) return false;
+                if (::unlink(saved_name.c_str()) != 0) {
+                    print_wrn("could not remove", saved_name);
+                }
+                print_inf("converted the allocation table of", name, "to", segments.size(), "segments");
+                return true;
             }
 
             std::pair<bool, u64> get_int_boot_value(u64 k) const {
                 if (error_count) return {false, u64()};
-                seek(constants.BOOT_TABLE_START + k * sizeof(u64), "int boot table");
-                u64 r = get<u64>();
+                auto u = pending_boot.find(k);
+                if (u != pending_boot.end()) {
+                    return {true, u->second};
+                }
+                u64 r = header.load<u64>(constants.BOOT_TABLE_START + k * sizeof(u64));
                 if (!r) {
                     return {false, r};
                 }
@@ -208,8 +761,11 @@ namespace persist {
 
             AllocationRecord get_alloc(u64 l) {
                 print_dbg("load allocation record at", l);
-                seek(constants.ALLOC_TABLE_START + sizeof(AllocationRecord) * l, "read alloc rec.");
-                return get<AllocationRecord>();
+                mapped_table *t = segment(l / constants.SEGMENT_RECORDS, false);
+                if (t == nullptr) {
+                    return {0, 0};
+                }
+                return t->load<AllocationRecord>(sizeof(AllocationRecord) * (l % constants.SEGMENT_RECORDS));
             }
 
         public:
@@ -225,12 +781,18 @@ namespace persist {
 
             ~file_storage_alloc() {
                 if (!name.empty()) {
-                    synch();
+                    checkpoint();
+                    unmap_tables();
+                    wal.close();
                 }
             }
 
             bool open(const std::string &file_name) {
+                unmap_tables();
+                free_space.clear();
+                pages.clear();
                 close();
+                wal.close();
                 if (!exists(file_name) && !create_file(file_name)) {
                     print_err("could not find nor create '%s'", file_name.c_str());
                     return false;
@@ -240,32 +802,59 @@ namespace persist {
                 }
 
                 name = file_name;
-                to_end();
-                file_size = tell();
-                seek(constants.VERSION_START, "open (version)");
+                file_size = structured_file::file_size();
 
                 if (file_size >= constants.HEADER_START + constants.HEADER_SIZE) {
-                    seek(constants.VERSION_START, "open (version)");
-                    if ((get<u64>() & 0x7FFFFFFF) == constants.FALLOC_VERSION) {
+                    if (!map_header()) {
+                        close();
+                        return false;
+                    }
+                    u64 format = header.load<u64>(constants.VERSION_START);
+                    if (format == constants.LEGACY_FALLOC_VERSION && !convert_legacy()) {
+                        print_err("could not convert the allocation table of", name);
+                        unmap_tables();
+                        close();
+                        return false;
+                    }
+                    format = header.load<u64>(constants.VERSION_START);
+                    if (format != constants.FALLOC_VERSION) {
                         print_err("invalid alloc file version");
+                        ++error_count;
+                        unmap_tables();
                         close();
                         return false;
                     }
+                    if (!open_log() || !replay_log() || !checkpoint()) {
+                        print_err("could not recover from", name + ".wal");
+                        return false;
+                    }
                     if (!(scan_allocation_map())) {
                         print_err("invalid alloc map");
                         return false;
                     }
+                    if (!rebuild_free_space()) {
+                        return false;
+                    }
                 }
 
                 if (file_size == 0) {
-                    seek(constants.HEADER_START, "open ( init header )");
-                    zero(constants.HEADER_SIZE);
-                    seek(constants.VERSION_START, "open ( init version )");
-                    set(constants.FALLOC_VERSION);
-                    commit_int_boot_value(Logical_Index, constants.MAX_BOOT_KEY + 1);
-                    synch();
-                    to_end();
-                    file_size = tell();
+                    // the header starts out as a hole, reading as zeros
+                    if (!resize(constants.HEADER_START + constants.HEADER_SIZE) || !map_header()) {
+                        print_err("could not create the allocation table of", name);
+                        close();
+                        return false;
+                    }
+                    header.store(constants.VERSION_START, constants.FALLOC_VERSION);
+                    write_int_boot_value(Logical_Index, constants.MAX_BOOT_KEY + 1);
+                    if (!flush_table(header)) {
+                        return false;
+                    }
+                    // a log left next to a new file belongs to some earlier one
+                    if (!open_log() || !wal.resize(0)) {
+                        return false;
+                    }
+                    wal_size = 0;
+                    file_size = structured_file::file_size();
                     // resize file
                     print_dbg("opened file '",file_name,"' with size",file_size);
                 } else if (file_size < constants.HEADER_START + constants.HEADER_SIZE) {
@@ -299,56 +888,131 @@ namespace persist {
                     return u64();
                 }
                 ++logical;
-                commit_int_boot_value(Logical_Index, logical);
+                // visible right away, logged with the next commit
+                pending_boot[Logical_Index] = logical;
+                logical_changed = true;
                 return logical;
             }
 
             AllocationRecord find_free_allocation(u64 size) {
-                if (free_map.empty()) return {0, 0};
-                AllocationRecord lsize{size, 0};
-                AllocationRecord result{size, 0};
-                auto l = free_map.lower_bound(lsize);
-                if (l != free_map.end()) {
-                    u64 r = l->size - size;
-                    AllocationRecord remaining{r, l->position + r};
-                    result.position = l->position;
-                    free_map.erase(l);
-                    if (r > 32) {
-                        free_map.insert(remaining);
-                    }
+                return free_space.allocate(size);
+            }
+
+            const free_extents &get_free_space() const {
+                return free_space;
+            }
+
+            page_cache &get_pages() {
+                return pages;
+            }
+
+            void release(const AllocationRecord &r) {
+                if (!free_space.insert(r)) {
+                    print_wrn("released space", r.to_string(), "is free already");
                 }
-                return result;
             }
-            // TODO: the logical parameter should be used or removed
-            AllocationRecord allocate_data(u64 /*logical*/, const buffer_type &data) {
+
+            /**
+             * the allocations closest to the end of the file, last first
+             * @param bytes stop once the allocations add up to this
+             * @return (logical, record) pairs
+             */
+            std::vector<std::pair<u64, AllocationRecord>> tail_allocations(u64 bytes) {
+                std::vector<std::pair<u64, AllocationRecord>> r;
+                u64 total = 0;
+                for (auto l = live.rbegin(); l != live.rend() && total < bytes; ++l) {
+                    auto ar = get_alloc(l->second);
+                    if (ar.position != l->first) continue;
+                    r.emplace_back(l->second, ar);
+                    total += ar.size;
+                }
+                return r;
+            }
+
+            /// free space ending at or before limit, see free_extents::allocate_below
+            AllocationRecord allocate_below(u64 size, u64 limit) {
+                if (error_count) return {0, 0};
+                return free_space.allocate_below(size, limit);
+            }
+
+            /// copies the stored bytes of an allocation to a new position
+            bool copy_data(const AllocationRecord &from, u64 to) {
+                if (error_count) return false;
+                thread_local buffer_type moving;
+                moving.resize(from.size);
+                if (!read_vec_at(moving, from.position, "read for relocation") || !write_at(moving, to)) {
+                    ++error_count;
+                    return false;
+                }
+                return true;
+            }
+
+            /**
+             * shrinks the file by the free space at its end
+             * @return the bytes released
+             */
+            u64 truncate_free_tail() {
+                if (error_count) return 0;
+                auto tail = free_space.take_tail(file_size);
+                if (tail.empty()) return 0;
+                if (!resize(tail.position)) {
+                    ++error_count;
+                    return 0;
+                }
+                file_size = tail.position;
+                print_dbg("truncated", tail.size, "bytes from", name);
+                return tail.size;
+            }
+
+            /// true if no transaction other than the callers one can see an older version
+            bool exclusive() const {
+                return version_list.size() == 1 && version_list.front().locks <= 1;
+            }
+
+            /**
+             * reserve space for a buffer without writing it, the caller writes the data
+             * at the returned position (i.e. through a batch submit) before commit
+             * @param size bytes required
+             * @return an empty record on error
+             */
+            AllocationRecord allocate_space(u64 size) {
+                if (error_count) return {0, 0};
                 if (file_size < constants.HEADER_START + constants.HEADER_SIZE) {
-                    print_dbg("error allocating",data.size(),"bytes at", file_size);
+                    print_dbg("error allocating",size,"bytes at", file_size);
                     ++error_count;
                     return {0, 0};
                 }
-                print_dbg("allocating",data.size(),"bytes at",file_size);
-                AllocationRecord falloc = find_free_allocation(data.size());
+                print_dbg("allocating",size,"bytes at",file_size);
+                AllocationRecord falloc = find_free_allocation(size);
                 if (!falloc.empty()) {
-                    seek(falloc.position, "re-alloc data");
-                    if (!structured_file::write(data)) {
-                        return {0, 0};
-                    }
                     return falloc;
                 }
-                if (tell() != file_size)
-                    seek(file_size, "alloc data");
-                if (!structured_file::write(data)) {
+                AllocationRecord result{size, file_size};
+                file_size += size;
+                print_dbg("allocated",size,"bytes (",result.position,"actual) at", file_size);
+                return result;
+            }
+            /**
+             * write a batch of buffers reserved with allocate_space, a failure fails the
+             * following commit
+             */
+            bool submit(io_batch &batch) {
+                if (error_count) return false;
+                if (!structured_file::submit(batch)) {
+                    ++error_count;
+                    return false;
+                }
+                return true;
+            }
+            // TODO: the logical parameter should be used or removed
+            AllocationRecord allocate_data(u64 /*logical*/, const buffer_type &data) {
+                AllocationRecord result = allocate_space(data.size());
+                if (result.empty()) {
                     return {0, 0};
                 }
-                u64 new_file_size = file_size + data.size(); //tell();
-                if (error_count) {
-                    print_dbg("error allocating",data.size(),"bytes", file_size);
+                if (!structured_file::write_at(data, result.position)) {
                     return {0, 0};
                 }
-                AllocationRecord result{data.size(), file_size};
-
-                file_size = new_file_size;
-                print_dbg("allocated",data.size(),"bytes (",result.position,"actual) at", file_size);
                 return result;
             }
             /**
@@ -441,10 +1105,11 @@ namespace persist {
                     // release allocated records here - only newly allocated ones
                     // TODO: free map can be to large in which case it needs to be compacted or something
                     print_dbg(r.to_string());
-                    free_map.insert(r); // we hope this always succeeds - should probably check duplicates
+                    release(r);
                 });
                 // release lock on mvc list and any allocated data
                 if(!unlock_version(tx.get_source_txid())) return false;
+                release_retired();
                 // the transaction is no longe valid and should be cleared  
                 tx.clear();
                 return true;
@@ -465,6 +1130,25 @@ namespace persist {
             template<typename _Transaction>
             bool commit(_Transaction &tx) {
                 if (error_count) return false;
+                thread_local prepared_commit c;
+                bool r = prepare(tx, c);
+                if (r) {
+                    log(c);
+                    r = complete(c);
+                }
+                return r || error_count > 0;
+            }
+
+            /**
+             * the part of commit that has to be serialized with the other users of the storage:
+             * the transaction is checked and applied in memory, where new transactions see it,
+             * and its log record is built. log(c) and complete(c) finish it, the caller may
+             * unlock for log and begin other transactions in between
+             * @return false if the commit was aborted, c is then empty
+             */
+            template<typename _Transaction>
+            bool prepare(_Transaction &tx, prepared_commit &c) {
+                if (error_count) return false;
 
                 // TODO: should we really do this so early - I would expect it to happen later
                 // i.e. something still missing
@@ -509,8 +1193,12 @@ namespace persist {
                                 abort_commit = true;
                                 return;
                             }
-                            // add old record to free list
-                            free_map.insert(a->second);
+                        }
+                        // the table holds the latest committed record, its space is free
+                        // once this commit is logged and no older transaction can read it
+                        auto previous = get_alloc(l);
+                        if (!previous.empty() && previous != r) {
+                            replaced.emplace_back(l, previous);
                         }
                         /// NB this is important and copies the new versions from the incoming transaction
                         /// overwrites if already exists
@@ -534,18 +1222,20 @@ namespace persist {
                 };// lambda commit_try
                 bool abort_commit = !commit_try();
                 if (abort_commit) {
-                    // TODO: try to replay undo log - if undo log cannot be replayed exit process
-                    // there is no recovery possible
+                    // nothing reached the log so the tables are as they were before this commit
                     // the new latest should be popped
                     if (new_latest)
                         remove_version(latest->txid); // latest is now invalid
+                    replaced.clear();
+                    log_alloc.clear();
+                    log_boot.clear();
                 } else {
-                    //TODO: erase the undo log again by writing a starting terminator
+                    encode_log(tx.get_version_id(), c);
+                    c.holder = latest->txid;
                 }
-                synch();
 
                 tx.clear();//? if there is a failure in the commit should the tx be cleared ?
-                return (!abort_commit || error_count > 0);
+                return !abort_commit;
             }
         };//file_storage_alloc
     }
@@ -0,0 +1,149 @@
+//
+// free space of a file_storage_alloc as coalesced extents
+//
+
+#ifndef REPLIFS_FREE_EXTENTS_H
+#define REPLIFS_FREE_EXTENTS_H
+
+#include <map>
+#include <set>
+#include "structured_file.h"
+
+namespace persist {
+    namespace storage {
+        /**
+         * unused ranges of a file indexed by address (to merge neighbours when they are
+         * released) and by size (for best fit allocation)
+         */
+        class free_extents {
+        public:
+            typedef std::map<u64, u64> _AddressMap; // position -> size
+            typedef std::set<std::pair<u64, u64>> _SizeSet; // (size, position)
+        private:
+            _AddressMap by_address;
+            _SizeSet by_size;
+            u64 total{0};
+
+            void add(u64 position, u64 size) {
+                by_address[position] = size;
+                by_size.insert({size, position});
+                total += size;
+            }
+
+            void erase(_AddressMap::iterator e) {
+                by_size.erase({e->second, e->first});
+                total -= e->second;
+                by_address.erase(e);
+            }
+
+        public:
+            /**
+             * releases a range, merging it with free neighbours
+             * @return false if the range overlaps free space already (a double release)
+             */
+            bool insert(u64 position, u64 size) {
+                if (size == 0) return true;
+                auto next = by_address.lower_bound(position);
+                if (next != by_address.end() && next->first < position + size) {
+                    return false;
+                }
+                if (next != by_address.begin()) {
+                    auto prev = std::prev(next);
+                    if (prev->first + prev->second > position) {
+                        return false;
+                    }
+                    if (prev->first + prev->second == position) {
+                        position = prev->first;
+                        size += prev->second;
+                        erase(prev);
+                    }
+                }
+                if (next != by_address.end() && position + size == next->first) {
+                    size += next->second;
+                    erase(next);
+                }
+                add(position, size);
+                return true;
+            }
+
+            bool insert(const AllocationRecord &r) {
+                return insert(r.position, r.size);
+            }
+
+            /**
+             * takes the smallest extent that fits from its start, the rest stays free
+             * @return {0, 0} if no extent is large enough
+             */
+            AllocationRecord allocate(u64 size) {
+                if (size == 0) return {0, 0};
+                auto f = by_size.lower_bound({size, 0});
+                if (f == by_size.end()) return {0, 0};
+                u64 position = f->second;
+                u64 remaining = f->first - size;
+                erase(by_address.find(position));
+                if (remaining > 0) {
+                    add(position + size, remaining);
+                }
+                return {size, position};
+            }
+
+            /**
+             * takes the lowest extent that fits and ends at or before limit, used to move
+             * data towards the start of the file
+             * @return {0, 0} if there is no such extent
+             */
+            AllocationRecord allocate_below(u64 size, u64 limit) {
+                if (size == 0) return {0, 0};
+                for (auto e = by_address.begin(); e != by_address.end() && e->first + size <= limit; ++e) {
+                    if (e->second >= size) {
+                        u64 position = e->first;
+                        u64 remaining = e->second - size;
+                        erase(e);
+                        if (remaining > 0) {
+                            add(position + size, remaining);
+                        }
+                        return {size, position};
+                    }
+                }
+                return {0, 0};
+            }
+
+            /**
+             * removes and returns the extent that ends exactly at end
+             * @return {0, 0} if the range before end is in use
+             */
+            AllocationRecord take_tail(u64 end) {
+                if (by_address.empty()) return {0, 0};
+                auto last = std::prev(by_address.end());
+                if (last->first + last->second != end) return {0, 0};
+                AllocationRecord r{last->second, last->first};
+                erase(last);
+                return r;
+            }
+
+            void clear() {
+                by_address.clear();
+                by_size.clear();
+                total = 0;
+            }
+
+            bool empty() const {
+                return by_address.empty();
+            }
+
+            size_t count() const {
+                return by_address.size();
+            }
+
+            /// free bytes
+            u64 bytes() const {
+                return total;
+            }
+
+            const _AddressMap &extents() const {
+                return by_address;
+            }
+        };
+    }
+}
+#endif //REPLIFS_FREE_EXTENTS_H
@@ -0,0 +1,233 @@
+//
+// decoded pages shared by all transactions of a file_storage_alloc
+//
+
+#ifndef REPLIFS_PAGE_CACHE_H
+#define REPLIFS_PAGE_CACHE_H
+
+#include <mutex>
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include "structured_file.h"
+
+namespace persist {
+    namespace storage {
+        enum cache_policy {
+            // least recently used
+            policy_lru = 0,
+            // 2Q: pages start on a small fifo and reach the main lru only when they are used
+            // again after falling off it, so a single scan cannot flush the working set
+            policy_2q
+        };
+
+        enum access_hint {
+            access_normal = 0,
+            // the page belongs to a sequential read and is unlikely to be used again soon
+            access_sequential
+        };
+
+        /**
+         * committed pages keyed by (logical address, version), a transaction hits as long as its
+         * snapshot resolves the address to the same allocation record - across commits too
+         * cached buffers are never modified, writers copy them first
+         */
+        class page_cache {
+        public:
+            typedef std::shared_ptr<buffer_type> _Page;
+        private:
+            enum {
+                SHARDS = 16,
+                // keys remembered after their page left the 2Q fifo
+                MIN_GHOSTS = 64
+            };
+            struct key {
+                u64 logical;
+                u64 version;
+
+                bool operator==(const key &k) const {
+                    return logical == k.logical && version == k.version;
+                }
+            };
+            struct key_hash {
+                size_t operator()(const key &k) const {
+                    return std::hash<u64>()(k.logical * 0x9E3779B97F4A7C15ull ^ k.version);
+                }
+            };
+            typedef std::list<key> _Recency;
+            struct entry {
+                AllocationRecord record;
+                _Page page;
+                _Recency::iterator recent;
+                // on the 2Q fifo instead of the main lru
+                bool probation;
+                bool sequential;
+            };
+            typedef std::unordered_map<key, entry, key_hash> _Entries;
+            struct shard {
+                std::mutex lock;
+                _Entries entries;
+                _Recency recency; // the (main) lru, most recent first
+                _Recency probation; // the 2Q fifo, newest first
+                u64 bytes{0};
+                u64 probation_bytes{0};
+                _Recency ghosts; // newest first
+                std::unordered_map<key, _Recency::iterator, key_hash> ghost_index;
+            };
+            shard shards[SHARDS];
+            u64 budget{128ull * 1024ull * 1024ull};
+            cache_policy policy{policy_2q};
+
+            shard &at(u64 logical) {
+                return shards[(logical * 0x9E3779B97F4A7C15ull >> 32) % SHARDS];
+            }
+
+            void remove(shard &s, _Entries::iterator e) {
+                s.bytes -= e->second.page->size();
+                if (e->second.probation) {
+                    s.probation_bytes -= e->second.page->size();
+                    s.probation.erase(e->second.recent);
+                } else {
+                    s.recency.erase(e->second.recent);
+                }
+                s.entries.erase(e);
+            }
+
+            void remember(shard &s, const key &k) {
+                s.ghosts.push_front(k);
+                s.ghost_index[k] = s.ghosts.begin();
+                while (s.ghosts.size() > std::max<size_t>(MIN_GHOSTS, s.entries.size())) {
+                    s.ghost_index.erase(s.ghosts.back());
+                    s.ghosts.pop_back();
+                }
+            }
+
+            bool forget(shard &s, const key &k) {
+                auto g = s.ghost_index.find(k);
+                if (g == s.ghost_index.end()) return false;
+                s.ghosts.erase(g->second);
+                s.ghost_index.erase(g);
+                return true;
+            }
+
+            void evict(shard &s) {
+                const u64 limit = budget / SHARDS;
+                while (s.bytes > limit && s.entries.size() > 1) {
+                    if (!s.probation.empty() && (s.probation_bytes > limit / 4 || s.recency.empty())) {
+                        auto e = s.entries.find(s.probation.back());
+                        if (!e->second.sequential) {
+                            remember(s, e->first);
+                        }
+                        remove(s, e);
+                    } else {
+                        remove(s, s.entries.find(s.recency.back()));
+                    }
+                }
+            }
+
+        public:
+            /**
+             * the page stored for an allocation record
+             * @return nullptr if it is not cached
+             */
+            _Page find(u64 logical, const AllocationRecord &record) {
+                auto &s = at(logical);
+                std::lock_guard<std::mutex> _lock(s.lock);
+                auto e = s.entries.find({logical, record.version});
+                if (e == s.entries.end() || e->second.record != record) {
+                    return nullptr;
+                }
+                if (!e->second.probation) { // 2Q leaves hits on the fifo where they are
+                    s.recency.splice(s.recency.begin(), s.recency, e->second.recent);
+                }
+                return e->second.page;
+            }
+
+            /**
+             * adds a page, pages are dropped by the policy to stay within budget
+             * @param hint sequential pages are the first to go and do not count as a use
+             */
+            void insert(u64 logical, const AllocationRecord &record, const _Page &page,
+                        access_hint hint = access_normal) {
+                if (page == nullptr || budget == 0) return;
+                auto &s = at(logical);
+                std::lock_guard<std::mutex> _lock(s.lock);
+                key k{logical, record.version};
+                auto e = s.entries.find(k);
+                if (e != s.entries.end()) {
+                    remove(s, e);
+                }
+                const bool sequential = hint == access_sequential;
+                bool probation = false;
+                _Recency::iterator recent;
+                if (policy == policy_lru) {
+                    recent = sequential ? s.recency.insert(s.recency.end(), k) : s.recency.insert(s.recency.begin(), k);
+                } else if (!sequential && forget(s, k)) { // used again after leaving the fifo
+                    recent = s.recency.insert(s.recency.begin(), k);
+                } else {
+                    probation = true;
+                    recent = sequential ? s.probation.insert(s.probation.end(), k) : s.probation.insert(s.probation.begin(), k);
+                    s.probation_bytes += page->size();
+                }
+                s.entries[k] = {record, page, recent, probation, sequential};
+                s.bytes += page->size();
+                evict(s);
+            }
+
+            /// forgets a page once its allocation is released
+            void erase(u64 logical, u64 version) {
+                auto &s = at(logical);
+                std::lock_guard<std::mutex> _lock(s.lock);
+                auto e = s.entries.find({logical, version});
+                if (e != s.entries.end()) {
+                    remove(s, e);
+                }
+            }
+
+            void clear() {
+                for (auto &s : shards) {
+                    std::lock_guard<std::mutex> _lock(s.lock);
+                    s.entries.clear();
+                    s.recency.clear();
+                    s.probation.clear();
+                    s.ghosts.clear();
+                    s.ghost_index.clear();
+                    s.bytes = 0;
+                    s.probation_bytes = 0;
+                }
+            }
+
+            /// changes the eviction policy, the cache starts empty
+            void set_policy(cache_policy p) {
+                clear();
+                policy = p;
+            }
+
+            cache_policy get_policy() const {
+                return policy;
+            }
+
+            /// the most bytes of pages kept, 0 disables the cache
+            void set_budget(u64 bytes) {
+                budget = bytes;
+                if (budget == 0) clear();
+            }
+
+            u64 get_budget() const {
+                return budget;
+            }
+
+            /// bytes of pages cached
+            u64 bytes() {
+                u64 r = 0;
+                for (auto &s : shards) {
+                    std::lock_guard<std::mutex> _lock(s.lock);
+                    r += s.bytes;
+                }
+                return r;
+            }
+        };
+    }
+}
+#endif //REPLIFS_PAGE_CACHE_H
@@ -16,6 +16,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#if defined(REPLIFS_IO_URING)
+#include <liburing.h>
+#endif
 
 namespace persist {
     namespace storage {
@@ -81,12 +91,103 @@ namespace persist {
 }
 namespace persist {
     namespace storage {
+        /**
+         * independent positional reads and writes submitted to a structured_file together
+         * the buffers must stay valid until submit returns, done(ok) is called for every
+         * request once it completed
+         */
+        class io_batch {
+        public:
+            typedef std::function<void(bool)> _Completion;
+            struct request {
+                bool write;
+                u8 *data;
+                size_t size;
+                u64 at;
+                _Completion done;
+            };
+            std::vector<request> requests;
+
+            void write(const u8 *data, size_t size, u64 at, _Completion done = nullptr) {
+                requests.push_back({true, const_cast<u8 *>(data), size, at, std::move(done)});
+            }
+
+            void read(u8 *data, size_t size, u64 at, _Completion done = nullptr) {
+                requests.push_back({false, data, size, at, std::move(done)});
+            }
+
+            bool empty() const {
+                return requests.empty();
+            }
+
+            size_t size() const {
+                return requests.size();
+            }
+
+            void clear() {
+                requests.clear();
+            }
+        };
+
+        /**
+         * a file accessed only through positional (pread/pwrite) calls - there is no shared
+         * file position so independent readers need no serialization and every access is a
+         * single system call
+         */
         class structured_file {
         private:
             //mutable std::fstream data_file; // stream representing file
             int fd{-1};
-            mutable off_t pos{0};
             std::string name;
+#if defined(REPLIFS_IO_URING)
+            enum {
+                RING_DEPTH = 64
+            };
+            struct io_uring ring;
+            bool ring_ready{false};
+            std::mutex ring_lock;
+#endif
+            // runs of requests of the same kind at adjacent positions, each run is
+            // one (p)readv/(p)writev or one io_uring submission entry
+            struct io_run {
+                size_t first;
+                size_t count;
+                size_t bytes;
+            };
+
+            void plan_runs(io_batch &batch, std::vector<io_run> &runs) const {
+                auto &rq = batch.requests;
+                std::sort(rq.begin(), rq.end(), [](const io_batch::request &l, const io_batch::request &r) -> bool {
+                    if (l.write != r.write) return l.write;
+                    return l.at < r.at;
+                });
+                runs.clear();
+                for (size_t i = 0; i < rq.size(); ++i) {
+                    if (!runs.empty()) {
+                        auto &last = runs.back();
+                        auto &prev = rq[last.first + last.count - 1];
+                        if (prev.write == rq[i].write && prev.at + prev.size == rq[i].at && last.count < IOV_MAX) {
+                            ++last.count;
+                            last.bytes += rq[i].size;
+                            continue;
+                        }
+                    }
+                    runs.push_back({i, 1, rq[i].size});
+                }
+            }
+
+            void fill_iov(const io_batch &batch, const io_run &run, std::vector<struct iovec> &iov) const {
+                iov.clear();
+                for (size_t i = run.first; i < run.first + run.count; ++i) {
+                    iov.push_back({batch.requests[i].data, batch.requests[i].size});
+                }
+            }
+
+            static void complete(io_batch &batch, const io_run &run, bool ok) {
+                for (size_t i = run.first; i < run.first + run.count; ++i) {
+                    if (batch.requests[i].done) batch.requests[i].done(ok);
+                }
+            }
         protected:
             mutable u64 error_count{0};
         public:
@@ -107,10 +208,24 @@ namespace persist {
             }
 
             u64 file_size() const {
-                to_end();
-                print_dbg("size",tell());
-                return tell();
+                if (error_count > 0) return 0;
+                struct stat st;
+                errno = 0;
+                if (::fstat(fd, &st) != 0) {
+                    check_error("stat");
+                    return 0;
+                }
+                print_dbg("size",st.st_size);
+                return st.st_size;
+            }
+
+#if defined(REPLIFS_IO_URING)
+            ~structured_file() {
+                if (ring_ready) {
+                    io_uring_queue_exit(&ring);
+                }
             }
+#endif
 
             void close() {
                 print_dbg("fd",fd);
@@ -118,6 +233,7 @@ namespace persist {
                     auto rval = ::close(fd);
                     print_dbg("rval",rval);
                     rval = 0;
+                    fd = -1;
                 }
                 name.clear();
             }
@@ -134,10 +250,18 @@ namespace persist {
                 return true;
             }
 
-            void synch() {
-                if (fd != -1) {
-
+            /// makes everything written so far durable, one call per commit
+            bool synch() {
+                if (fd == -1) {
+                    return false;
                 }
+                errno = 0;
+#if defined(__APPLE__)
+                ::fsync(fd); // no fdatasync
+#else
+                ::fdatasync(fd);
+#endif
+                return check_error("synch");
             }
 
             bool create_file(const std::string &file_name) {
@@ -166,144 +290,288 @@ namespace persist {
                 return true;
             }
 
-            bool seek(u64 to, const char *where) const {
-                if (error_count > 0) {
-                    return false;
-                }
-                if(where){
-                    print_dbg("seeking for ", where,"->", where, to);  
-                }
-                
-                errno = 0;
-                off_t at = ::lseek(fd, to, SEEK_SET);
-                if (at > -1) pos = at;
-                return check_error("seek");
-            }
-
-            u64 tell() const {
-                if (error_count > 0) return 0;
-
-                return pos;
-            }
-
             template<typename _vT>
-            bool read(_vT *buffer, size_t count) const {
+            bool read_at(_vT *buffer, size_t count, u64 at) const {
                 if (error_count > 0) return false;
                 errno = 0;
                 size_t start = 0;
                 while (start != count) {
-                    print_dbg("reading part", count - start,"bytes");
-                    int r = ::read(fd, (void *) &buffer[0], count - start);
+                    print_dbg("reading part", count - start,"bytes at", at + start);
+                    ssize_t r = ::pread(fd, (void *) ((char *) buffer + start), count - start, at + start);
                     if (r == -1) {
+                        if (errno == EINTR) continue;
                         return check_error("read");
                     }
+                    if (r == 0) {
+                        print_err("could not read file", name, "- unexpected end");
+                        ++error_count;
+                        return false;
+                    }
                     start += r;
-                    pos += r;
                 }
                 print_dbg("ok", count,"bytes");
                 return true;
             }
 
             template<typename _vT>
-            bool read_vec(_vT &buffer) {
+            bool read_vec_at(_vT &buffer, u64 address, const char *where) const {
                 if (error_count > 0) return false;
-                print_dbg("reading",buffer.size());
-                return this->read(&buffer[0], buffer.size());
+                print_dbg("buffer size",buffer.size(),"address",address, where);
+                if (buffer.empty()) return true;
+                return read_at(&buffer[0], buffer.size(), address);
             }
 
-            template<typename _vT>
-            bool read_vec_at(_vT &buffer, u64 address, const char *where) {
+            /// scatter read of consecutive bytes at into the iov buffers
+            bool readv_at(const struct iovec *iov, int count, u64 at) const {
                 if (error_count > 0) return false;
-                print_dbg("buffer size",buffer.size(),"address",address);
-                if (!seek(address, where)) {
-                    return check_error("read_at");
+                size_t total = 0;
+                for (int i = 0; i < count; ++i) total += iov[i].iov_len;
+                errno = 0;
+                ssize_t r = ::preadv(fd, iov, count, at);
+                if (r == -1) {
+                    return check_error("read");
                 }
-                
-                return read_vec(buffer);
-            }
-
-            template<typename _vT>
-            bool read(_vT &primitive) const {
-                if (error_count > 0) return false;
-                print_dbg("primitive size",sizeof(_vT));
-                return this->read<char>((char *) &primitive, sizeof(_vT));
-            }
-
-            template<typename _vT>
-            bool set(const _vT &primitive) {
-                if (error_count > 0) return false;
-                std::array<u8, sizeof(_vT)> encoded;
-                primitive::encode(encoded.begin(), encoded.end(), primitive);
-                print_dbg("writing at", tell(), sizeof(_vT));
-                return this->write((const char *) encoded.data(), sizeof(_vT));
+                if ((size_t) r == total) {
+                    return true;
+                }
+                // short read - finish buffer by buffer
+                size_t done = r;
+                for (int i = 0; i < count; ++i) {
+                    size_t l = iov[i].iov_len;
+                    if (done >= l) {
+                        done -= l;
+                    } else {
+                        if (!read_at((char *) iov[i].iov_base + done, l - done, at + done)) {
+                            return false;
+                        }
+                        done = 0;
+                    }
+                    at += l;
+                }
+                return true;
             }
 
             template<typename _vT>
-            _vT get() const {
+            _vT get_at(u64 at) const {
                 _vT r = _vT();
                 std::array<u8, sizeof(_vT)> encoded;
-                if (!read(encoded)) {
-                    
+                if (!read_at(encoded.data(), encoded.size(), at)) {
                     return r;
                 }
-                print_dbg("get",sizeof(_vT),"->",encoded.size());
+                print_dbg("get",sizeof(_vT),"at",at);
                 primitive::decode(r, encoded.begin(), encoded.end());
                 return r;
             }
 
             template<typename _vT>
-            bool write(const _vT *buffer, const size_t count) {
+            bool set_at(u64 at, const _vT &primitive) {
+                if (error_count > 0) return false;
+                std::array<u8, sizeof(_vT)> encoded;
+                primitive::encode(encoded.begin(), encoded.end(), primitive);
+                print_dbg("writing at", at, sizeof(_vT));
+                return this->write_at((const char *) encoded.data(), sizeof(_vT), at);
+            }
+
+            template<typename _vT>
+            bool write_at(const _vT *buffer, const size_t count, u64 at) {
                 if (error_count > 0) return false;
-                print_dbg("writing at", tell(), count);
+                print_dbg("writing at", at, count);
                 errno = 0;
                 size_t start = 0;
                 while (start != count) {
-                    int r = ::write(fd, (const char *) &buffer[start], count - start);
+                    ssize_t r = ::pwrite(fd, (const char *) buffer + start, count - start, at + start);
                     if (r == -1) {
+                        if (errno == EINTR) continue;
                         return check_error("write");
                     }
                     start += r;
-                    pos += r;
                 }
                 return true;
             }
 
             template<typename _vT>
-            bool write(const _vT &buffer) {
-                return write(buffer.data(), buffer.size());
+            bool write_at(const _vT &buffer, u64 at) {
+                return write_at(buffer.data(), buffer.size(), at);
             }
 
-            bool zero(size_t count) {
+            /// gather write of the iov buffers as consecutive bytes at
+            bool writev_at(const struct iovec *iov, int count, u64 at) {
+                if (error_count > 0) return false;
+                size_t total = 0;
+                for (int i = 0; i < count; ++i) total += iov[i].iov_len;
+                errno = 0;
+                ssize_t r = ::pwritev(fd, iov, count, at);
+                if (r == -1) {
+                    return check_error("write");
+                }
+                if ((size_t) r == total) {
+                    return true;
+                }
+                size_t done = r;
+                for (int i = 0; i < count; ++i) {
+                    size_t l = iov[i].iov_len;
+                    if (done >= l) {
+                        done -= l;
+                    } else {
+                        if (!write_at((const char *) iov[i].iov_base + done, l - done, at + done)) {
+                            return false;
+                        }
+                        done = 0;
+                    }
+                    at += l;
+                }
+                return true;
+            }
+
+            /**
+             * performs every request in the batch and waits for them, requests are sorted by
+             * position and adjacent ones are coalesced. with io_uring all runs of a batch are in
+             * flight together instead of one at a time
+             * @return false if any request failed
+             */
+            bool submit(io_batch &batch) {
+                if (error_count > 0) return false;
+                if (batch.empty()) return true;
+                thread_local std::vector<io_run> runs;
+                thread_local std::vector<struct iovec> iov;
+                plan_runs(batch, runs);
+                bool ok = true;
+#if defined(REPLIFS_IO_URING)
+                std::unique_lock<std::mutex> _lock(ring_lock);
+                if (!ring_ready) {
+                    int e = io_uring_queue_init(RING_DEPTH, &ring, 0);
+                    if (e < 0) {
+                        print_err("could not create io_uring for", name, "-", std::strerror(-e));
+                        ++error_count;
+                        return false;
+                    }
+                    ring_ready = true;
+                }
+                thread_local std::vector<std::vector<struct iovec>> iovs;
+                for (size_t start = 0; start < runs.size(); start += RING_DEPTH) {
+                    size_t end = std::min<size_t>(runs.size(), start + RING_DEPTH);
+                    iovs.resize(RING_DEPTH);
+                    for (size_t r = start; r < end; ++r) {
+                        auto &v = iovs[r - start];
+                        fill_iov(batch, runs[r], v);
+                        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+                        if (batch.requests[runs[r].first].write) {
+                            io_uring_prep_writev(sqe, fd, v.data(), v.size(), batch.requests[runs[r].first].at);
+                        } else {
+                            io_uring_prep_readv(sqe, fd, v.data(), v.size(), batch.requests[runs[r].first].at);
+                        }
+                        io_uring_sqe_set_data(sqe, (void *) (uintptr_t) r);
+                    }
+                    int e = io_uring_submit(&ring);
+                    if (e < 0) {
+                        print_err("could not submit io to", name, "-", std::strerror(-e));
+                        ++error_count;
+                        return false;
+                    }
+                    for (size_t done = start; done < end; ++done) {
+                        struct io_uring_cqe *cqe = nullptr;
+                        e = io_uring_wait_cqe(&ring, &cqe);
+                        if (e < 0) {
+                            print_err("could not complete io on", name, "-", std::strerror(-e));
+                            ++error_count;
+                            return false;
+                        }
+                        size_t r = (size_t) (uintptr_t) io_uring_cqe_get_data(cqe);
+                        int res = cqe->res;
+                        io_uring_cqe_seen(&ring, cqe);
+                        auto &run = runs[r];
+                        bool run_ok = res >= 0;
+                        if (run_ok && (size_t) res != run.bytes) {
+                            // short transfer - finish it synchronously
+                            auto &v = iovs[r - start];
+                            run_ok = batch.requests[run.first].write
+                                     ? writev_at(v.data(), v.size(), batch.requests[run.first].at)
+                                     : readv_at(v.data(), v.size(), batch.requests[run.first].at);
+                        } else if (!run_ok) {
+                            print_err("io failed on", name, "-", std::strerror(-res));
+                            ++error_count;
+                        }
+                        complete(batch, run, run_ok);
+                        ok = ok && run_ok;
+                    }
+                }
+#else
+                for (auto &run : runs) {
+                    fill_iov(batch, run, iov);
+                    auto &first = batch.requests[run.first];
+                    bool run_ok = first.write ? writev_at(iov.data(), iov.size(), first.at)
+                                              : readv_at(iov.data(), iov.size(), first.at);
+                    complete(batch, run, run_ok);
+                    ok = ok && run_ok;
+                }
+#endif
+                return ok;
+            }
+
+            bool zero_at(u64 at, size_t count) {
                 if (error_count > 0) return false;
                 static const u8 ZEROES[4096]{0};
                 size_t remaining = count;
                 print_dbg("count", count);
                 while (remaining) {
                     size_t todo = std::min<size_t>(remaining, sizeof(ZEROES));
-                    if (!write(&ZEROES[0], todo)) {
+                    if (!write_at(&ZEROES[0], todo, at)) {
                         return false;
                     }
                     remaining -= todo;
+                    at += todo;
+                }
+                return true;
+            }
+
+            /// truncates or extends the file
+            bool resize(size_t newlen) {
+                if (error_count > 0) return false;
+                errno = 0;
+                if (::ftruncate(fd, newlen) != 0) {
+                    return check_error("resize");
                 }
                 return true;
             }
 
-            bool to_end() const {
+            /**
+             * maps a range of the file shared and writable, stores to it reach the file
+             * without a syscall and become durable with flush_mapped
+             * @param at must be a multiple of the page size
+             * @param count the file must be at least at + count bytes
+             * @return nullptr on error
+             */
+            u8 *map_at(u64 at, size_t count) {
+                if (error_count > 0) return nullptr;
+                errno = 0;
+                void *r = ::mmap(nullptr, count, PROT_READ | PROT_WRITE, MAP_SHARED, fd, at);
+                if (r == MAP_FAILED) {
+                    check_error("map");
+                    return nullptr;
+                }
+                return (u8 *) r;
+            }
+
+            bool unmap(u8 *mapped, size_t count) {
+                if (mapped == nullptr) return true;
+                errno = 0;
+                if (::munmap(mapped, count) != 0) {
+                    return check_error("unmap");
+                }
+                return true;
+            }
+
+            /// makes the stores to [from, to) of a mapping durable
+            bool flush_mapped(u8 *mapped, u64 from, u64 to) {
                 if (error_count > 0) return false;
+                if (mapped == nullptr || from >= to) return true;
+                const u64 page = ::sysconf(_SC_PAGESIZE);
+                from -= from % page;
                 errno = 0;
-                
-                off_t at = ::lseek(fd, 0, SEEK_END);
-                print_dbg("at", at);
-                if (at > -1) pos = at;
-                return check_error("to end");
-            }
-
-            // TODO: implement 
-            void resize(size_t /*newlen*/) {
-                // truncate file
-                //auto current = tell();
-                //std::filesystem::resize_file(name, newlen);
-                //seek(std::min<size_t>(newlen,current),"resize");
+                if (::msync(mapped + from, to - from, MS_SYNC) != 0) {
+                    return check_error("msync");
+                }
+                return true;
             }
 
             const std::string &get_name() const {
@@ -7,6 +7,7 @@
 #include "storage/memory_storage_alloc.h"
 #include "storage/file_storage_alloc.h"
 #include "storage/transaction.h"
+#include "storage/compactor.h"
 #include "logging/console.h"
 #include "bt_tx_ctx.h"
 #include <random>
@@ -391,6 +392,432 @@ static void test_file_alloc() {
 
 
 
+static void test_free_extents() {
+    stage = "free extents";
+    nst::free_extents free;
+    test_assert(free.insert(1000, 100), {"insert failed"});
+    test_assert(free.insert(1200, 100), {"insert failed"});
+    test_assert(free.insert(1100, 100), {"insert between failed"});
+    test_assert(free.count() == 1 && free.bytes() == 300, {"neighbours not merged", free.count()});
+    test_assert(!free.insert(1250, 10), {"double release accepted"});
+    auto a = free.allocate(50);
+    test_assert(a.position == 1000 && a.size == 50, {"allocation not at the start", a.to_string()});
+    test_assert(free.insert(a), {"release failed"});
+    test_assert(free.count() == 1 && free.bytes() == 300, {"release not merged"});
+    test_assert(free.insert(2000, 40), {"insert failed"});
+    auto b = free.allocate(40);
+    test_assert(b.position == 2000, {"not best fit", b.to_string()});
+    test_assert(free.allocate(400).empty(), {"allocation larger than free space"});
+    auto t = free.take_tail(1300);
+    test_assert(t.position == 1000 && t.size == 300 && free.empty(), {"tail not taken", t.to_string()});
+    log({"free extent test complete"});
+}
+
+static void test_clock_cache() {
+    stage = "clock cache";
+    clock_cache<nst::u64, int> cache(4);
+    std::vector<nst::u64> evicted;
+    auto on_evict = [&](const nst::u64 &k, const int &) { evicted.push_back(k); };
+    for (nst::u64 k = 1; k <= 4; ++k) {
+        cache.insert(k, (int) k, on_evict);
+    }
+    test_assert(cache.find(1) != nullptr && *cache.find(1) == 1, {"value not found"});
+    cache.insert(5, 5, on_evict);
+    test_assert(evicted.size() == 1 && evicted[0] == 2, {"referenced entry evicted"});
+    test_assert(cache.count(2) == 0 && cache.size() == 4, {"evicted entry still cached"});
+    test_assert(cache.erase(3) && !cache.erase(3), {"erase failed"});
+    cache.insert(6, 6, on_evict);
+    test_assert(evicted.size() == 1, {"eviction with a free slot"});
+    size_t flushed = 0;
+    cache.flush([&](const nst::u64 &, const int &) { ++flushed; });
+    test_assert(flushed == 4 && cache.empty(), {"flush left entries", flushed});
+    log({"clock cache test complete"});
+}
+
+static void test_key_coding() {
+    stage = "key coding";
+    typedef persist::key_coding<std::string> coding;
+    nst::transaction storage; // strings are coded without it
+    std::vector<std::string> keys = {"", "a", "abc", "abcd", "abd", "b", std::string(300, 'x'), std::string(300, 'x') + "y"};
+    for (int i = 0; i < 40; ++i) {
+        keys.push_back("dir/entry" + std::to_string(100 + i));
+    }
+    nst::buffer_type buffer;
+    size_t size = 0;
+    for (size_t k = 0; k < keys.size(); ++k) {
+        size += coding::size(storage, k % coding::restart ? &keys[k - 1] : nullptr, keys[k]);
+    }
+    buffer.resize(size);
+    auto writer = buffer.begin();
+    for (size_t k = 0; k < keys.size(); ++k) {
+        writer = coding::write(storage, writer, buffer.end(), k % coding::restart ? &keys[k - 1] : nullptr, keys[k]);
+    }
+    test_assert(writer == buffer.end(), {"size does not match what was written", size, writer - buffer.begin()});
+    std::vector<std::string> read(keys.size());
+    nst::buffer_type::const_iterator reader = buffer.begin();
+    for (size_t k = 0; k < keys.size(); ++k) {
+        reader = coding::read(storage, buffer, reader, k % coding::restart ? &read[k - 1] : nullptr, read[k]);
+        test_assert(read[k] == keys[k], {"key changed", k, read[k]});
+    }
+    test_assert(reader == buffer.end(), {"keys not read to the end"});
+    buffer.resize(buffer.size() - 1);
+    bool truncated = false;
+    try {
+        reader = buffer.begin();
+        for (size_t k = 0; k < keys.size(); ++k) {
+            reader = coding::read(storage, buffer, reader, k % coding::restart ? &read[k - 1] : nullptr, read[k]);
+        }
+    } catch (persist::bad_format &) {
+        truncated = true;
+    }
+    test_assert(truncated, {"truncated keys accepted"});
+    log({"key coding test complete"});
+}
+
+static void test_value_coding() {
+    stage = "value coding";
+    typedef persist::value_coding<replifs::BtValue> coding;
+    nst::transaction storage; // inline values are coded without it
+    std::vector<replifs::BtValue> values(4);
+    values[1].bytes = std::string(replifs::BtValue::INLINE_MAX, 's');
+    values[2].address = 1;
+    values[3].address = 1ull << 40;
+    nst::buffer_type buffer;
+    size_t size = 0;
+    for (auto &v : values) {
+        size += coding::size(storage, v);
+    }
+    buffer.resize(size);
+    auto writer = buffer.begin();
+    for (auto &v : values) {
+        writer = coding::write(storage, writer, buffer.end(), v);
+    }
+    test_assert(writer == buffer.end(), {"size does not match what was written", size, writer - buffer.begin()});
+    nst::buffer_type::const_iterator reader = buffer.begin();
+    for (auto &v : values) {
+        replifs::BtValue r;
+        r.address = 7;
+        reader = coding::read(storage, buffer, reader, r);
+        test_assert(r.address == v.address && r.bytes == v.bytes, {"value changed", v.address, r.address});
+    }
+    test_assert(reader == buffer.end(), {"values not read to the end"});
+    log({"value coding test complete"});
+}
+
+static void test_hinted_access() {
+    stage = "hinted access";
+    memory_storage_alloc storage;
+    typedef persist::btree_map<uint64_t, uint64_t, memory_storage_alloc> bt_t;
+    bt_t t1(storage);
+    const uint64_t keys = 20000;
+    for (uint64_t k = 0; k < keys; k += 2) {
+        t1.insert(k, k + 1);
+    }
+    // a sorted sweep that misses every other key, each lookup hinted by the last hit
+    bt_t::iterator hint = t1.end();
+    bool found = false;
+    for (uint64_t k = 0; k < keys; ++k) {
+        auto at = found ? t1.find(hint, k) : t1.find(k);
+        test_assert((at != t1.end()) == (k % 2 == 0), {"hinted find", k});
+        if (at == t1.end()) continue;
+        test_assert(at.key() == k && at.data() == k + 1, {"hinted find returned another key", k});
+        hint = at;
+        found = true;
+    }
+    hint = t1.insert2(0, 0).first;
+    for (uint64_t k = 0; k < keys; ++k) {
+        hint = t1.insert2(hint, k, 0);
+        test_assert(hint.key() == k, {"hinted insert returned another key", k});
+        hint.data() = k * 3;
+    }
+    hint = t1.end();
+    t1.insert2(hint, keys, keys * 3); // an end hint descends from the root
+    for (uint64_t k = 0; k <= keys; ++k) {
+        auto at = t1.find(k);
+        test_assert(at != t1.end() && at.data() == k * 3, {"hinted insert lost a value", k});
+    }
+    log({"hinted access test complete"});
+}
+
+static void test_page_cache() {
+    stage = "page cache";
+    nst::page_cache cache;
+    cache.set_budget(16 * 400); // four 100 byte pages per shard
+    auto page = std::make_shared<nst::buffer_type>(100);
+    auto record = [](nst::u64 v) { return nst::AllocationRecord{100, 4096 * v, v}; };
+    // the same logical address always lands in the same shard
+    for (nst::u64 v = 1; v <= 5; ++v) {
+        cache.insert(7, record(v), page);
+    }
+    test_assert(cache.find(7, record(1)) == nullptr, {"first page not evicted"});
+    cache.insert(7, record(1), page); // used again after it was evicted
+    for (nst::u64 v = 100; v < 110; ++v) {
+        cache.insert(7, record(v), page); // a scan
+    }
+    test_assert(cache.find(7, record(1)) != nullptr, {"2Q lost the working set to a scan"});
+    test_assert(cache.bytes() <= 400, {"budget exceeded", cache.bytes()});
+    cache.set_policy(nst::policy_lru);
+    test_assert(cache.bytes() == 0, {"policy change kept pages"});
+    for (nst::u64 v = 1; v <= 3; ++v) {
+        cache.insert(7, record(v), page);
+    }
+    cache.insert(7, record(4), page, nst::access_sequential);
+    cache.insert(7, record(5), page);
+    test_assert(cache.find(7, record(4)) == nullptr, {"sequential page not evicted first"});
+    test_assert(cache.find(7, record(1)) != nullptr, {"lru page evicted before a sequential one"});
+    log({"page cache test complete"});
+}
+
+static void test_compaction() {
+    stage = "compaction";
+    const nst::u64 items = 10000;
+    nst::u64 first = 0;
+    {
+        nst::file_storage_alloc storage;
+        nst::transaction tx(&storage);
+        storage.open("./test_compact_data.dat");
+        for (nst::u64 i = 0; i < items; ++i) {
+            nst::u64 w = 0;
+            auto &buffer = tx.allocate(w, persist::storage::create);
+            if (i == 0) first = w;
+            buffer.resize(256);
+            memcpy(buffer.data(), &i, sizeof(i));
+            tx.complete();
+        }
+        test_assert(tx.commit() && tx.begin(), {"could not commit"});
+        // rewriting the first half moves it to the end and leaves a hole at the start
+        for (nst::u64 i = 0; i < items / 2; ++i) {
+            nst::u64 w = first + i;
+            auto &buffer = tx.allocate(w, persist::storage::write);
+            nst::u64 v = i + items;
+            memcpy(buffer.data(), &v, sizeof(v));
+            tx.complete();
+        }
+        test_assert(tx.commit() && tx.begin(), {"could not commit"});
+        nst::u64 before = storage.size();
+        nst::compactor compaction(&storage);
+        compaction.set_rate(1024 * 1024 * 1024);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        compaction.step(tx);
+        test_assert(compaction.get_moved() > 0 && storage.size() < before, {"nothing compacted", before, storage.size()});
+        log({"compacted", before, "to", storage.size(), "bytes"});
+    }
+    {
+        nst::file_storage_alloc storage;
+        nst::transaction tx(&storage);
+        storage.open("./test_compact_data.dat");
+        for (nst::u64 i = 0; i < items; ++i) {
+            nst::u64 w = first + i;
+            auto &buffer = tx.allocate(w, persist::storage::read);
+            nst::u64 v = 0;
+            memcpy(&v, buffer.data(), sizeof(v));
+            tx.complete();
+            if (v != (i < items / 2 ? i + items : i)) {
+                test_error({"relocated data changed at", w});
+                return;
+            }
+        }
+    }
+}
+
+static void test_retired_records() {
+    stage = "retired records";
+    nst::file_storage_alloc storage;
+    nst::transaction writer(&storage);
+    storage.open("./test_retired_data.dat");
+    nst::u64 w = 0;
+    {
+        auto &buffer = writer.allocate(w, persist::storage::create);
+        buffer.assign(4096, 'a');
+        writer.complete();
+    }
+    test_assert(writer.commit() && writer.begin(), {"could not commit"});
+    nst::transaction reader(&storage); // started on the first version
+    {
+        auto &buffer = writer.allocate(w, persist::storage::write);
+        buffer.assign(4096, 'b');
+        writer.complete();
+    }
+    test_assert(writer.commit() && writer.begin(), {"could not commit"});
+    // the reader may still read the record the commit replaced, it is released with the reader
+    nst::u64 before = storage.get_free_space().bytes();
+    test_assert(reader.rollback(), {"could not end the reader"});
+    test_assert(storage.get_free_space().bytes() >= before + 4096, {"record not held for the reader", w});
+    log({"retired records test complete"});
+}
+
+static void test_log_replay() {
+    stage = "log replay";
+    const std::string name = "./test_wal_data.dat";
+    auto read_file = [](const std::string &from) {
+        std::ifstream in(from, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    auto write_file = [](const std::string &to, const std::string &bytes) {
+        std::ofstream out(to, std::ios::binary | std::ios::trunc);
+        out.write(bytes.data(), bytes.size());
+    };
+    ::unlink(name.c_str());
+    ::unlink((name + ".wal").c_str());
+    nst::u64 w = 0;
+    std::string data1, log1, log2;
+    {
+        nst::file_storage_alloc storage;
+        nst::transaction tx(&storage);
+        storage.open(name);
+        auto &buffer = tx.allocate(w, persist::storage::create);
+        buffer.assign(64, 'a');
+        tx.complete();
+        test_assert(tx.commit() && tx.begin(), {"could not commit"});
+        // the tables are stored to but the log is not checkpointed while the file is open
+        data1 = read_file(name);
+        log1 = read_file(name + ".wal");
+        tx.set_boot_value(42, 1);
+        test_assert(tx.commit(), {"could not commit"});
+        log2 = read_file(name + ".wal");
+    }
+    test_assert(!log1.empty() && log2.size() > log1.size(), {"commits were not logged", log1.size(), log2.size()});
+    auto reopen = [&](const std::string &log, nst::u64 boot) {
+        write_file(name, data1);
+        write_file(name + ".wal", log);
+        nst::file_storage_alloc storage;
+        nst::transaction tx(&storage);
+        test_assert(storage.open(name), {"could not recover", name});
+        auto &buffer = tx.allocate(w, persist::storage::read);
+        test_assert(std::string(buffer.begin(), buffer.end()) == std::string(64, 'a'), {"record lost at", w});
+        tx.complete();
+        nst::u64 value = 0;
+        tx.get_boot_value(value, 1);
+        test_assert(value == boot, {"boot value", value, "is not", boot});
+        test_assert(read_file(name + ".wal").empty(), {"log not checkpointed at open"});
+    };
+    // the first commit is replayed again over the tables it was already stored to
+    reopen(log2, 42);
+    // a torn record ends the log
+    reopen(log2.substr(0, log2.size() - 1), 0);
+    // so do garbage and a record that does not match its checksum, even with a valid
+    // record after them
+    reopen(log1 + std::string(64, '\x5a') + log2.substr(log1.size()), 0);
+    std::string corrupt = log2;
+    corrupt[corrupt.size() - sizeof(nst::u64) - 1] ^= 1;
+    reopen(corrupt + log2.substr(log1.size()), 0);
+    log({"log replay test complete"});
+}
+
+static void test_legacy_table() {
+    stage = "legacy table";
+    const nst::Constants constants;
+    const std::string name = "./test_legacy_data.dat";
+    // records in the first segment, where the directory goes, and in a later one
+    const std::vector<nst::u64> logical = {constants.MAX_BOOT_KEY + 2, 1000, 70000};
+    {
+        ::unlink(name.c_str());
+        nst::structured_file legacy;
+        test_assert(legacy.create_file(name) && legacy.open_file(name), {"could not create", name});
+        nst::u64 at = constants.LEGACY_HEADER_SIZE;
+        test_assert(legacy.resize(at + logical.size() * 4096), {"could not size", name});
+        legacy.set_at<nst::u64>(constants.VERSION_START, constants.LEGACY_FALLOC_VERSION);
+        legacy.set_at<nst::u64>(constants.BOOT_TABLE_START + 4 * sizeof(nst::u64), logical.back() + 1);
+        for (nst::u64 l : logical) {
+            nst::AllocationRecord ar(64, at, 1);
+            legacy.set_at(constants.LEGACY_TABLE_START + l * sizeof(nst::AllocationRecord), ar);
+            std::string data(64, (char) ('a' + l % 26));
+            legacy.write_at(data.data(), data.size(), at);
+            at += 4096;
+        }
+        legacy.close();
+    }
+    for (int reopen = 0; reopen < 2; ++reopen) {
+        nst::file_storage_alloc storage;
+        nst::transaction tx(&storage);
+        test_assert(storage.open(name), {"could not open", name});
+        for (nst::u64 l : logical) {
+            nst::u64 w = l;
+            auto &buffer = tx.allocate(w, persist::storage::read);
+            std::string data(buffer.begin(), buffer.end());
+            tx.complete();
+            test_assert(data == std::string(64, (char) ('a' + l % 26)), {"record lost in conversion at", l});
+        }
+        nst::u64 w = 0;
+        auto &buffer = tx.allocate(w, persist::storage::create);
+        buffer.assign(64, 'z');
+        tx.complete();
+        test_assert(w > logical.back() && tx.commit(), {"could not allocate after conversion", w});
+    }
+    test_assert(!nst::structured_file().exists(name + ".legacy"), {"conversion left", name + ".legacy"});
+    log({"legacy table test complete"});
+}
+
+static void test_graph_migration() {
+    stage = "graph migration";
+    typedef replifs::GraphDB graph_t;
+    const uint64_t items = 5000; // more than one migration step
+    const uint64_t names = 1, numbers = 2;
+    auto legacy_key = [](uint32_t type, uint64_t context) {
+        std::string k;
+        replifs::encode(k, type);
+        replifs::encode(k, context);
+        return k;
+    };
+    // some blocks too large to be inline
+    auto block = [](uint64_t i) {
+        return std::string(i % 2 ? 300 : 8, (char) ('a' + i % 26)) + std::to_string(i);
+    };
+    ::unlink("./bt_repli_data.dat");
+    ::unlink("./bt_repli_data.dat.wal");
+    {
+        // keys as they were written before the format was recorded
+        replifs::BtDb db;
+        graph_t::StringData data;
+        std::string k, v;
+        for (uint64_t i = 0; i < items; ++i) {
+            data.id = 1000 + i;
+            data.value = "v" + std::to_string(i);
+            db.put(legacy_key(graph_t::External, names) + "f" + std::to_string(i), data.serialize(v));
+            k = legacy_key(graph_t::ExternalNumber, numbers);
+            replifs::encode(k, i);
+            data.value = block(i);
+            db.put(k, data.serialize(v));
+        }
+        test_assert(db.sync(), {"could not write legacy keys"});
+    }
+    {
+        graph_t graph{"./replifs_data"};
+        test_assert(!graph.opened() && graph.format() == graph_t::FORMAT_LEGACY, {"legacy store not detected"});
+        int64_t moved = graph.migrate([](int64_t) {});
+        test_assert(moved >= (int64_t) (2 * items) && graph.opened(), {"migration failed", moved});
+    }
+    graph_t graph{"./replifs_data"};
+    test_assert(graph.opened() && graph.format() == graph_t::FORMAT, {"migrated store not current"});
+    graph_t::StringData data;
+    for (uint64_t i = 0; i < items; i += 7) {
+        test_assert(graph.by_string(data, names, "f" + std::to_string(i)) && data.id == 1000 + i &&
+                    data.value == "v" + std::to_string(i), {"by_string lost", i});
+        test_assert(graph.by_number(data, numbers, i) && data.id == 1000 + i && data.value == block(i),
+                    {"by_number lost", i});
+    }
+    uint64_t found = 0;
+    graph.iterate(names, std::string(), [&](const std::string &name, uint64_t id, const std::string &value) -> bool {
+        uint64_t i = id - 1000;
+        test_assert(name == "f" + std::to_string(i) && value == "v" + std::to_string(i), {"iterated name", name});
+        ++found;
+        return true;
+    });
+    test_assert(found == items, {"iterated", found, "names of", items});
+    found = 0;
+    graph.iterate(numbers, (uint64_t) 0, [&](uint64_t number, uint64_t id, const std::string &value) -> bool {
+        test_assert(number == found && id == 1000 + number && value == block(number), {"iterated number", number});
+        ++found;
+        return true;
+    });
+    test_assert(found == items, {"iterated", found, "numbers of", items});
+    graph_t::prefix_string_iterator after;
+    graph_t::Node node;
+    test_assert(graph.seek(after, names, "f10", false) && after.read(node) && node.name == "f100",
+                {"seek after f10 found", node.name});
+    log({"graph migration test complete"});
+}
+
 static inline void test_tx_alloc() {
     stage = "tx allocation";
     nst::file_storage_alloc storage;
@@ -781,6 +1208,28 @@ static int test() {
         test_stage();
         test_tx_alloc();
         test_stage();
+        test_clock_cache();
+        test_stage();
+        test_page_cache();
+        test_stage();
+        test_key_coding();
+        test_stage();
+        test_value_coding();
+        test_stage();
+        test_hinted_access();
+        test_stage();
+        test_free_extents();
+        test_stage();
+        test_compaction();
+        test_stage();
+        test_retired_records();
+        test_stage();
+        test_log_replay();
+        test_stage();
+        test_legacy_table();
+        test_stage();
+        test_graph_migration();
+        test_stage();
         stage = "all";
     }
 
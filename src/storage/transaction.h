@@ -6,6 +6,8 @@
 #define REPLIFS_TRANSACTION_H
 
 #include "file_storage_alloc.h"
+#include "clock_cache.h"
+#include <tuple>
 //#include "rabbit/unordered_map"
 namespace persist {
     namespace storage {
@@ -19,9 +21,8 @@ namespace persist {
         private:
             const Constants constants;
             //TODO: make these sizes configurable and or automatic
-            lru_cache<u64, std::shared_ptr<buffer_type>> data_cache{10000};
             // write buffer to speedup multiple writes to the same buffer
-            lru_cache<u64, std::shared_ptr<buffer_type>> write_buffer{2000};
+            clock_cache<u64, std::shared_ptr<buffer_type>> write_buffer{2000};
             // only data read from other transactions is stored here
             std::unordered_map<u64, AllocationRecord> read_allocation_map;
             // only data allocated in *this* transaction is stored here
@@ -71,6 +72,43 @@ namespace persist {
                 this->set_int_boot(k, val);
                 return true;
             }
+            // find the current buffer for an existing address in the write buffer, the shared
+            // page cache or storage, returns end_buffer if the address has no data
+            // hint tells the page cache how a page read from storage is used
+            std::shared_ptr<buffer_type> load(u64 address, access_hint hint = access_normal) {
+                auto wvi = write_buffer.find(address); // check the write buffer first
+                if (wvi != nullptr) {
+                    return *wvi;
+                }
+                auto ar = get_alloc(address);
+                if (ar.empty()) {
+                    return end_buffer; // nothing found
+                }
+                auto cached = fa->get_pages().find(address, ar);
+                if (cached != nullptr) {
+                    return cached;
+                }
+                auto r = std::make_shared<buffer_type>();
+                r->resize(ar.size);
+                if (!fa->read_vec_at(*r, ar.position, "read for data")) { // read data from storage into buffer
+                    return end_buffer;
+                }
+                if (allocation_map.count(address) == 0) { // only committed pages are shared
+                    fa->get_pages().insert(address, ar, r, hint);
+                }
+                return r;
+            }
+
+            // true if someone outside this transaction (the page cache or a reader from pin())
+            // still holds the buffer
+            bool is_pinned(u64 address, const std::shared_ptr<buffer_type> &r) const {
+                long holders = 1; // r itself
+                if (current == r) ++holders;
+                auto w = write_buffer.peek(address);
+                if (w != nullptr && *w == r) ++holders;
+                return r.use_count() > holders;
+            }
+
             // allocate some new space and only record the new allocation in this transaction
             void flush_buffer(const u64 &logical, const std::shared_ptr<buffer_type> &buff){
                 auto ar = fa->allocate_data(logical, *buff);
@@ -95,7 +133,6 @@ namespace persist {
                 allocation_map.clear();
                 boot_map.clear();
                 write_buffer.clear();
-                data_cache.clear();
                 source_txid = 0;
             }
 
@@ -164,9 +201,7 @@ namespace persist {
             template<typename _Ft>
             void iter_write_buf(_Ft &&cb) {
                 print_dbg("iterating write buffers");
-                for (auto b:write_buffer) {
-                    cb(b.first, b.second);
-                }
+                write_buffer.for_each(cb);
             }
 
             template<typename _Ft>
@@ -243,27 +278,10 @@ namespace persist {
                         //data_cache.insert(address,r);
                     }
                 } else { // if action != create
-                    auto wvi = write_buffer.find(address); // check the write buffer first
-                    if (wvi.first) {
-                        r = wvi.second;
-                    } else {
-                        auto dvi = data_cache.find(address);
-                        if (!dvi.first) {
-                            auto ar = get_alloc(address);
-                            if (ar.empty()) {
-                                r = end_buffer; // nothing found
-                            } else {
-
-                                r = std::make_shared<buffer_type>();
-                                r->resize(ar.size);
-                                if (!fa->read_vec_at(*r, ar.position,
-                                                     "read for data")) { // read data from storage into buffer
-                                    r = end_buffer;
-                                }
-                            }
-                        } else {
-                            r = dvi.second;
-                        }
+                    r = load(address);
+                    if (action != storage_action::read && r != end_buffer && is_pinned(address, r)) {
+                        // copy on write so that pinned readers keep seeing the version they pinned
+                        r = std::make_shared<buffer_type>(*r);
                     }
                 }
                 current_logical = address;
@@ -275,6 +293,30 @@ namespace persist {
                 return *r;
             }
 
+            /**
+             * returns the decoded buffer at a logical address for reading without copying it
+             * the buffer stays valid and unchanged for as long as the caller holds the pointer
+             * even if it is written to in the meantime (writers copy pinned buffers)
+             * @param address the logical address
+             * @param hint access_sequential for pages of a sequential read, they leave the
+             * page cache first
+             * @return nullptr if there is no data at the address
+             */
+            std::shared_ptr<buffer_type> pin(u64 address, access_hint hint = access_normal) {
+                if (fa == nullptr) {
+                    print_err("transaction not attached");
+                    return nullptr;
+                }
+                if (!source_txid) {
+                    print_err("transaction not started");
+                    return nullptr;
+                }
+                if (error_count || address == 0) return nullptr;
+                auto r = load(address, hint);
+                if (r == end_buffer) return nullptr;
+                return r;
+            }
+
             // this function will write the modified buffer into storage - the storage is
             // responsible for allocating this buffer
             // if allocate is called before this function then the changes are lost
@@ -392,7 +434,6 @@ namespace persist {
                 }
                 // start with empty buffers (TODO: optimize later, maybe)
                 write_buffer.clear();
-                data_cache.clear();
                 read_allocation_map.clear();
                 fa->begin(*this);
                 return true;
@@ -409,12 +450,30 @@ namespace persist {
                 }
                 // buffers are invalid now
                 write_buffer.clear();
-                data_cache.clear();
                 read_allocation_map.clear();
                 return fa->rollback(*this);
             }
 
             bool commit() {
+                if (!write_dirty()) return false;
+                return finish(fa->commit(*this));
+            }
+
+            /**
+             * commit up to the log record, which fa->log(c) writes and fa->complete(c) finishes.
+             * the transaction can begin again right away, it sees the prepared changes
+             */
+            bool prepare(file_storage_alloc::prepared_commit &c) {
+                if (!write_dirty()) return false;
+                return finish(fa->prepare(*this, c));
+            }
+
+        private:
+            typedef std::vector<std::tuple<u64, AllocationRecord, std::shared_ptr<buffer_type>>> _Written;
+            // the buffers written by the commit in progress
+            _Written written;
+
+            bool write_dirty() {
                 if (fa == nullptr) {
                     print_err("transaction not attached");
                     return false;
@@ -424,15 +483,38 @@ namespace persist {
                     return false;
                 }
                 print_dbg("commit", source_txid);
+                // the remaining dirty buffers are written as one batch instead of one
+                // write per buffer, the batch keeps them alive until it is submitted
+                io_batch batch;
+                written.clear();
                 write_buffer.flush(
-                    // if the write buffer is full this function will be called on eviction
                     [&](const u64 &logical, const std::shared_ptr<buffer_type> &buff) {
-                        flush_buffer(logical, buff);
+                        auto ar = fa->allocate_space(buff->size());
+                        if (ar.empty()) {
+                            print_err("could not allocate data after write");
+                            return;
+                        }
+                        ar.version = get_version_id();
+                        written.emplace_back(logical, ar, buff);
+                        batch.write(buff->data(), buff->size(), ar.position);
+                        write_allocation_record(ar, logical);
                     }
                 );
-                bool r = fa->commit(*this);
+                if (!fa->submit(batch)) {
+                    print_err("could not write data during commit");
+                }
+                return true;
+            }
+
+            bool finish(bool r) {
+                if (r && fa->is_open()) {
+                    // the pages just written are the ones most likely to be read next
+                    for (auto &p : written) {
+                        fa->get_pages().insert(std::get<0>(p), std::get<1>(p), std::get<2>(p));
+                    }
+                }
+                written.clear();
                 write_buffer.clear(); // buffers have been delivered (they will spoil the next transaction)
-                data_cache.clear(); // these buffers may be spoilt in a multi user environment
                 read_allocation_map.clear(); // start over now
                 return r;
             }
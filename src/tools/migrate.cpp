@@ -0,0 +1,36 @@
+//
+// rewrites a replifs data store in the current format
+//
+
+#include <unistd.h>
+#include <iostream>
+#include "storage/BTGraphDB.h"
+
+int main(int argc, char *argv[]) {
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        std::cerr << "usage: " << argv[0] << " [directory]" << std::endl;
+        std::cerr << "    migrates the data store in directory (the current one by default)" << std::endl;
+        return 1;
+    }
+    // the data store lives in the working directory of the file system
+    if (argc == 2 && chdir(argv[1]) != 0) {
+        std::cerr << "could not change to " << argv[1] << std::endl;
+        return 1;
+    }
+    replifs::GraphDB graph{"./replifs_data"};
+    if (graph.opened()) {
+        std::cout << "data store is already at format " << graph.format() << std::endl;
+        return 0;
+    }
+    std::cout << "migrating data store from format " << graph.format() << std::endl;
+    int64_t keys = graph.migrate([](int64_t done) {
+        std::cout << "\r" << done << " keys and values" << std::flush;
+    });
+    std::cout << std::endl;
+    if (keys < 0) {
+        std::cerr << "migration failed, running it again continues where it stopped" << std::endl;
+        return 1;
+    }
+    std::cout << "migrated " << keys << " keys and values to format " << graph.format() << std::endl;
+    return 0;
+}